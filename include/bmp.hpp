@@ -1,5 +1,10 @@
+#pragma once
+
 #include "common.hpp"
+#include "imagesink.hpp"
 #include <vector>
+#include <string>
+#include <fstream>
 
 namespace cocogfx {
 
@@ -9,6 +14,19 @@ int LoadBMP(const char *filename,
             uint32_t *height,
             uint32_t *bpp);
 
+int LoadBMP(const char *filename, 
+            ImageSink &sink);
+
+int LoadBMP(std::istream &is, 
+            ImageSink &sink);
+
+// reads the file header only
+int ProbeBMP(std::istream &is, 
+             uint32_t *width,
+             uint32_t *height,
+             uint32_t *channels,
+             ePixelFormat *format);
+
 int SaveBMP(const char *filename, 
             const uint8_t* pixels, 
             uint32_t width,
@@ -16,4 +34,33 @@ int SaveBMP(const char *filename,
             uint32_t bpp,
             int32_t pitch);
 
+// Streaming BMP encoder, rows must be written top to bottom.
+class BMPWriter : public ImageSink {
+public:
+  BMPWriter(const char *filename);
+
+  BMPWriter(std::ostream &os);
+
+  int begin(uint32_t width,
+            uint32_t height,
+            ePixelFormat format) override;
+
+  int writeRows(const uint8_t* rows,
+                uint32_t y,
+                uint32_t count,
+                int32_t pitch) override;
+
+  int finish() override;
+
+private:
+  std::string filename_;
+  std::ofstream ofs_;
+  std::ostream* os_;
+  std::vector<uint8_t> row_;
+  uint32_t width_;
+  uint32_t bpp_;
+  uint32_t height_;
+  uint32_t next_row_;
+};
+
 }
\ No newline at end of file
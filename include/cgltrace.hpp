@@ -119,6 +119,12 @@ public:
     uint32_t height;
     std::vector<uint8_t> pixels;
 
+    // HashImage() of the pixel content, computed on demand
+    uint64_t computeHash() const;
+
+    // content comparison, hashing both sides would cost more than the
+    // memcmp, so the hash-first reject lives where hashes are reused:
+    // dedupTextures() and the binary writer bucket by computeHash()
     bool operator==(const texture_t& rhs) const;
   };
 
@@ -152,22 +158,103 @@ public:
     bool blend_enabled;
     eBlendOp blend_src;
     eBlendOp blend_dst;
+
+    bool operator==(const states_t& rhs) const;
+
+    bool operator!=(const states_t& rhs) const {
+      return !(*this == rhs);
+    }
+  };
+
+  // Interned render states, identical states_t share one id so a replayer
+  // can skip redundant state setup by comparing ids.
+  class StateTable {
+  public:
+    // returns the id of the matching state, adding it if new
+    uint32_t intern(const states_t& states);
+
+    const states_t& operator[](uint32_t id) const {
+      return states_[id];
+    }
+
+    size_t size() const {
+      return states_.size();
+    }
+
+    void clear() {
+      states_.clear();
+      lookup_.clear();
+    }
+
+  private:
+    std::vector<states_t> states_;
+    std::unordered_multimap<uint64_t, uint32_t> lookup_;
   };
 
+  // primitives index directly into the dense vertex array
   struct drawcall_t {
     states_t states;
     uint32_t texture_id;
-    std::unordered_map<uint32_t, vertex_t> vertices;
+    std::vector<vertex_t> vertices;
     std::vector<primitive_t> primitives;
     viewport_t viewport;
   };
 
+  enum eArchive {
+    ARCHIVE_BINARY, // compact little-endian sections, see cgltracefile.hpp
+    ARCHIVE_XML,    // boost xml, for debugging
+  };
+
+  // binary archive section compression
+  enum eCompression {
+    COMPRESSION_NONE,
+    COMPRESSION_FAST, // LZ4, loads near raw speed
+    COMPRESSION_HIGH, // deflate level 6
+  };
+
+  struct load_stats_t {
+    uint64_t file_size;
+    double   seconds;
+    double   throughput; // file MB/s
+  };
+
   std::vector<drawcall_t> drawcalls;
   std::unordered_map<uint32_t, texture_t> textures;  
 
-  int load(const char* filename);
+  // the archive type is detected from the file content,
+  // binary archive sections are decoded in parallel, aliased textures
+  // load as drawcalls referencing their target id
+  int load(const char* filename, load_stats_t* stats = nullptr);
+
+  // compression only applies to binary archives
+  int save(const char* filename,
+           eArchive archive = ARCHIVE_BINARY,
+           eCompression compression = COMPRESSION_NONE);
+
+  // convert a trace file to the given archive type
+  static int Convert(const char* src_filename,
+                     const char* dst_filename,
+                     eArchive archive,
+                     eCompression compression = COMPRESSION_NONE);
+
+  // merge textures with identical content, drawcalls are remapped to the
+  // lowest id of each group, returns the number of textures removed
+  size_t dedupTextures();
+
+  // build the dense vertex array of a drawcall from sparse captured indices,
+  // primitives are remapped in first-use order, unreferenced vertices dropped
+  static int CompactVertices(const std::unordered_map<uint32_t, vertex_t>& vertices,
+                             drawcall_t* drawcall);
+
+private:
+
+  int loadXML(const char* filename, uint64_t* file_size);
+
+  int saveXML(const char* filename);
+
+  int loadBinary(const char* filename, uint64_t* file_size);
 
-  int save(const char* filename);
+  int saveBinary(const char* filename, eCompression compression);
 };
 
 }
\ No newline at end of file
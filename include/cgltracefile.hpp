@@ -0,0 +1,268 @@
+#pragma once
+
+#include "common.hpp"
+#include "cgltrace.hpp"
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace cocogfx {
+
+// Binary CGLTrace archive layout, all values are little-endian.
+//
+//   file_header_t
+//   section_header_t + payload, repeated
+//   SECTION_INDEX
+//   SECTION_END
+//
+// Sections are length-prefixed so readers can skip unknown ones.
+// The index lists the offset of every section, the END payload holds the
+// offset of the index so readers can locate it from the end of the file.
+namespace TraceFile {
+
+enum {
+  MAGIC   = 0x544c4743, // "CGLT"
+  VERSION = 1,
+};
+
+enum eSection {
+  SECTION_TEXTURE  = 0x52584554, // "TEXR"
+  SECTION_DRAWCALL = 0x57415244, // "DRAW"
+  SECTION_ALIAS    = 0x53494c41, // "ALIS" u32 id, u32 texture id
+  SECTION_STATES   = 0x54415453, // "STAT" state table entries
+  SECTION_INDEX    = 0x58444e49, // "INDX"
+  SECTION_END      = 0x20444e45, // "END "
+};
+
+// index payload: u32 count followed by count index_entry_t
+struct index_entry_t {
+  uint32_t tag;
+  uint32_t id;     // texture id, drawcall ordinal or first state id
+  uint64_t offset; // section header offset from the file start
+};
+
+struct file_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct section_header_t {
+  uint32_t tag;
+  uint32_t flags;
+  uint64_t size; // payload bytes following the header
+};
+
+// State table payload: u32 first id, u32 count, then per state a u32
+// changed-field bitmask against the previous state id (all-zero states for
+// id 0) followed by the changed fields. Drawcalls store a u32 state id.
+
+enum eSectionFlags {
+  SECTION_FLAG_COMPRESSED = 0x1,
+};
+
+// Compressed payload:
+//   u32 codec, u32 chunk count, u64 decompressed size
+//   chunk count x (u32 raw size, u32 stored size)
+//   chunk data
+// Chunks hold COMPRESS_CHUNK_SIZE bytes of the payload, the last one less.
+// A chunk stored at its raw size is not compressed.
+enum eCodec {
+  CODEC_DEFLATE = 1, // zlib stream per chunk
+  CODEC_LZ4     = 2, // LZ4 block per chunk
+};
+
+enum {
+  FILE_HEADER_SIZE    = 16,
+  SECTION_HEADER_SIZE = 16,
+  INDEX_ENTRY_SIZE    = 16,
+};
+
+enum {
+  WRITER_FLUSH_SIZE   = 1024 * 1024,      // pending sections are flushed past this
+  WRITER_STATE_BATCH  = 256,              // new states per state table section
+  COMPRESS_CHUNK_SIZE = 256 * 1024,
+  COMPRESS_MIN_SIZE   = 64 * 1024,        // smaller payloads are kept raw
+  READER_BATCH_SIZE   = 64 * 1024 * 1024, // decompressed bytes per readTrace() pass
+};
+
+}
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  int open(const char* filename);
+
+  void close();
+
+  const uint8_t* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const uint8_t* data_;
+  size_t size_;
+  std::vector<uint8_t> buffer_; // fallback without mmap
+};
+
+// Append-only binary trace writer for incremental capture.
+// Sections are staged in a bounded buffer and flushed as it fills, only the
+// section index (16 bytes per section) grows with the trace. finish() writes
+// the index and END sections; it is called on destruction if needed. After a
+// failed write the trace is closed without them and finish() returns -1.
+// Textures with the same content as an earlier one are written as an alias,
+// drawcall states are interned and written as delta-encoded table batches.
+class CGLTraceWriter {
+public:
+  CGLTraceWriter();
+  ~CGLTraceWriter();
+
+  int beginTrace(const char* filename,
+                 CGLTrace::eCompression compression = CGLTrace::COMPRESSION_NONE);
+
+  int addTexture(uint32_t id, const CGLTrace::texture_t& texture);
+
+  int addDrawcall(const CGLTrace::drawcall_t& drawcall);
+
+  int finish();
+
+  size_t drawcallCount() const {
+    return drawcall_count_;
+  }
+
+  // textures written as an alias
+  size_t aliasCount() const {
+    return alias_count_;
+  }
+
+private:
+  CGLTraceWriter(const CGLTraceWriter&);
+  CGLTraceWriter& operator=(const CGLTraceWriter&);
+
+  struct texture_entry_t {
+    uint32_t id;
+    uint64_t offset; // section header offset
+  };
+
+  // compare against a texture section already written
+  bool matchTexture(uint64_t offset, const CGLTrace::texture_t& texture);
+
+  // returns the section start in buffer_
+  size_t beginSection(uint32_t tag, uint32_t id);
+
+  int endSection(size_t start);
+
+  int flush();
+
+  int writeStates();
+
+  std::ofstream ofs_;
+  std::string filename_;
+  uint32_t codec_; // 0 when disabled
+  int compress_level_;
+  std::vector<uint8_t> buffer_;
+  std::vector<uint8_t> index_;
+  uint32_t index_count_;
+  uint64_t offset_; // file offset of buffer_
+  size_t drawcall_count_;
+  size_t alias_count_;
+  std::unordered_multimap<uint64_t, texture_entry_t> texture_hashes_;
+  CGLTrace::StateTable states_;
+  uint32_t written_states_;
+  bool failed_; // a write failed, the trace is not finalized
+};
+
+// Lazy binary trace reader over a memory-mapped file.
+// open() only reads the section index, drawcalls and textures are decoded
+// on access so a replay only pays for what it touches. Chunks of large
+// compressed sections are decompressed in parallel.
+// Const accessors are safe to call from multiple threads.
+class CGLTraceReader {
+public:
+  // zero-copy texture view into the mapping, valid until close(),
+  // aliased ids share the pixels of their target.
+  // Compressed sections are decoded into buffer, owned by the view.
+  struct texture_view_t {
+    ePixelFormat format;
+    uint32_t width;
+    uint32_t height;
+    const uint8_t* pixels;
+    size_t size;
+    std::shared_ptr<std::vector<uint8_t>> buffer;
+  };
+
+  CGLTraceReader();
+  ~CGLTraceReader();
+
+  int open(const char* filename);
+
+  void close();
+
+  size_t drawcallCount() const {
+    return drawcalls_.size();
+  }
+
+  size_t fileSize() const {
+    return file_.size();
+  }
+
+  const std::vector<uint32_t>& textureIds() const {
+    return texture_ids_;
+  }
+
+  int getDrawcall(size_t index,
+                  CGLTrace::drawcall_t* drawcall,
+                  uint32_t* state_id = nullptr) const;
+
+  // unique drawcall states, indexed by state id
+  const CGLTrace::StateTable& states() const {
+    return states_;
+  }
+
+  int getTexture(uint32_t id, CGLTrace::texture_t* texture) const;
+
+  int getTextureView(uint32_t id, texture_view_t* view) const;
+
+  // decode every texture and drawcall into trace, the chunks of all
+  // compressed sections and then the sections form flat parallel work lists.
+  // Aliased ids are not materialized, their drawcalls use the target id.
+  int readTrace(CGLTrace* trace) const;
+
+private:
+
+  struct section_t {
+    const uint8_t* data;
+    size_t size;
+    uint32_t flags;
+  };
+
+  int buildIndex();
+
+  int addSection(uint32_t tag, uint32_t id, uint64_t offset);
+
+  int decodeStates();
+
+  void clearSections();
+
+  MappedFile file_;
+  std::vector<section_t> drawcalls_;
+  std::unordered_map<uint32_t, section_t> textures_;
+  std::unordered_map<uint32_t, uint32_t> aliases_;
+  std::vector<uint32_t> texture_ids_;
+  std::vector<section_t> state_sections_;
+  CGLTrace::StateTable states_;
+};
+
+}
@@ -470,10 +470,10 @@ inline static const FormatInfo &GetInfo(ePixelFormat pixelFormat) {
       __formatInfo(FORMAT_A1R5G5B5),
       __formatInfo(FORMAT_R8G8B8),
       __formatInfo(FORMAT_A4R4G4B4),
-      __formatInfo(FORMAT_R4G4B4A4),
+      __formatInfo(FORMAT_A8B8G8R8),
       __formatInfo(FORMAT_R5G5B5A1),
       __formatInfo(FORMAT_B8G8R8),
-      __formatInfo(FORMAT_A8B8G8R8),
+      __formatInfo(FORMAT_R4G4B4A4),
       __formatInfo(FORMAT_D16),
       __formatInfo(FORMAT_X8S8D16),
       __formatInfo(FORMAT_PAL4_B8G8R8),
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "imagehash.hpp"
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace cocogfx {
+
+// Thread-safe cache of decoded images keyed on path, modification time and
+// pixel format. Least recently used entries are evicted once the decoded
+// bytes exceed the budget; evicted buffers stay valid for their holders.
+// Concurrent requests for the same image share a single decode.
+class ImageCache {
+public:
+  ImageCache(size_t max_bytes = 256 * 1024 * 1024);
+
+  // returns 0 on success, -1 if the file cannot be decoded; exceptions
+  // thrown by the decode reach every waiter and nothing is cached
+  int load(const char *filename,
+           ePixelFormat format,
+           SharedImage *image);
+
+  void clear();
+
+  // decoded bytes currently held
+  size_t size() const;
+
+  uint64_t hits() const;
+
+  uint64_t misses() const;
+
+private:
+
+  struct entry_t {
+    std::shared_future<SharedImage> image;
+    std::list<std::string>::iterator lru;
+    size_t bytes;
+    bool ready;
+  };
+
+  void evict();
+
+  size_t max_bytes_;
+  size_t bytes_;
+  uint64_t hits_;
+  uint64_t misses_;
+  std::unordered_map<std::string, entry_t> entries_;
+  std::list<std::string> lru_; // most recent first
+  mutable std::mutex mutex_;
+};
+
+}
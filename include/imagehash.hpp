@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.hpp"
+#include "format.hpp"
+#include <memory>
+#include <vector>
+
+namespace cocogfx {
+
+// Streaming 64-bit hash, same output as XXH64.
+class Hasher64 {
+public:
+  Hasher64(uint64_t seed = 0);
+
+  void update(const void* data, size_t size);
+
+  uint64_t digest() const;
+
+private:
+  uint64_t v_[4];
+  uint64_t seed_;
+  uint64_t total_;
+  uint8_t  buffer_[32];
+  uint32_t buffered_;
+};
+
+// hash of the pixel content, the format and dimensions are part of the key
+uint64_t HashImage(const uint8_t* pixels,
+                   ePixelFormat format,
+                   uint32_t width,
+                   uint32_t height,
+                   int32_t pitch);
+
+// 64-bit difference hash (dHash) of the luma downsampled to 9x8,
+// similar images differ by few bits
+uint64_t PerceptualHashImage(const uint8_t* pixels,
+                             ePixelFormat format,
+                             uint32_t width,
+                             uint32_t height,
+                             int32_t pitch);
+
+// number of differing bits between two perceptual hashes
+inline uint32_t HashDistance(uint64_t hash1, uint64_t hash2) {
+  uint64_t x = hash1 ^ hash2;
+  uint32_t count = 0;
+  while (x) {
+    x &= x - 1;
+    ++count;
+  }
+  return count;
+}
+
+// Decoded image sharing its immutable pixel buffer with every other
+// image of identical content.
+struct SharedImage {
+  std::shared_ptr<const std::vector<uint8_t>> pixels;
+  uint32_t width;
+  uint32_t height;
+  ePixelFormat format;
+  uint64_t hash;            // HashImage
+  uint64_t perceptual_hash; // PerceptualHashImage, 0 unless requested
+
+  SharedImage()
+    : width(0)
+    , height(0)
+    , format(FORMAT_UNKNOWN)
+    , hash(0)
+    , perceptual_hash(0)
+  {}
+};
+
+// Look up identical content in the process-wide dedup table, the buffer
+// is moved into the table when no match exists. Entries do not keep
+// their buffer alive, it is released with its last SharedImage.
+// thread-safe.
+SharedImage InternImage(std::vector<uint8_t>&& pixels,
+                        ePixelFormat format,
+                        uint32_t width,
+                        uint32_t height,
+                        bool perceptual_hash = false);
+
+// LoadImage returning a deduplicated shared buffer
+int LoadSharedImage(const char *filename,
+                    ePixelFormat format,
+                    SharedImage *image,
+                    bool perceptual_hash = false);
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "common.hpp"
+#include "format.hpp"
+#include <vector>
+
+namespace cocogfx {
+
+// Incremental image consumer.
+// begin() is called once with the image dimensions, followed by writeRows()
+// for bands of rows covering [y, y + count), then finish().
+// Bands arrive top to bottom without gaps, pitch may be negative.
+// Returning a non-zero value aborts the transfer.
+class ImageSink {
+public:
+  virtual ~ImageSink() {}
+
+  virtual int begin(uint32_t width,
+                    uint32_t height,
+                    ePixelFormat format) = 0;
+
+  virtual int writeRows(const uint8_t* rows,
+                        uint32_t y,
+                        uint32_t count,
+                        int32_t pitch) = 0;
+
+  virtual int finish() {
+    return 0;
+  }
+};
+
+// Collects streamed rows into a contiguous pixel buffer.
+class ImageBufferSink : public ImageSink {
+public:
+  ImageBufferSink(std::vector<uint8_t>& pixels);
+
+  int begin(uint32_t width,
+            uint32_t height,
+            ePixelFormat format) override;
+
+  int writeRows(const uint8_t* rows,
+                uint32_t y,
+                uint32_t count,
+                int32_t pitch) override;
+
+  uint32_t width() const {
+    return width_;
+  }
+
+  uint32_t height() const {
+    return height_;
+  }
+
+  ePixelFormat format() const {
+    return format_;
+  }
+
+private:
+  std::vector<uint8_t>& pixels_;
+  uint32_t width_;
+  uint32_t height_;
+  ePixelFormat format_;
+};
+
+// native pixel format of decoded image files
+inline ePixelFormat GetImageFormat(uint32_t bpp) {
+  switch (bpp) {
+  case 1:
+    return FORMAT_A8;
+  case 2:
+    return FORMAT_R5G6B5;
+  case 3:
+    return FORMAT_R8G8B8;
+  case 4:
+    return FORMAT_A8R8G8B8;
+  default:
+    return FORMAT_UNKNOWN;
+  }
+}
+
+// rows per streamed band, about 64KB worth of pixels
+inline uint32_t GetBandRows(uint32_t row_size) {
+  uint32_t rows = (64 * 1024) / (row_size ? row_size : 1);
+  return rows ? rows : 1;
+}
+
+}
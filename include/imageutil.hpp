@@ -16,28 +16,289 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <functional>
+#include <iosfwd>
+#include <cstdio>
 #include "format.hpp"
+#include "math.hpp"
+#include "imagesink.hpp"
+#include "png.hpp"
 
 namespace cocogfx {
 
+enum eImageType {
+  IMAGE_UNKNOWN,
+  IMAGE_TGA,
+  IMAGE_PNG,
+  IMAGE_BMP,
+};
+
+struct ImageInfo {
+  eImageType type;
+  uint32_t width;
+  uint32_t height;
+  uint32_t channels;            // color channels stored in the file
+  cocogfx::ePixelFormat format; // native format, before conversion
+};
+
+// detect the image type from its content and read its dimensions without
+// decoding. Only headers are read, PNG chunks up to the image data are
+// skipped over, and the stream position is restored so the same stream can
+// be passed to LoadImage afterwards. The stream must be seekable.
+int ProbeImage(std::istream &is, ImageInfo *info);
+
+// read the image metadata from the file header only, no pixel data is
+// decoded or allocated.
+int QueryImageInfo(const char *filename, ImageInfo *info);
+
+// the image type is detected from the file content
+int LoadImage(const char *filename,
+              cocogfx::ePixelFormat format,
+              std::vector<uint8_t> &pixels,
+              uint32_t *width,
+              uint32_t *height);
+
+// streaming decode: converted rows are delivered to the sink in bands
 int LoadImage(const char *filename,
+              cocogfx::ePixelFormat format,
+              ImageSink &sink);
+
+// decode from an encoded image in memory, the type is detected from its content
+int LoadImage(const uint8_t* data,
+              size_t size,
               cocogfx::ePixelFormat format,
               std::vector<uint8_t> &pixels,
               uint32_t *width,
               uint32_t *height);
 
+int LoadImage(const uint8_t* data,
+              size_t size,
+              cocogfx::ePixelFormat format,
+              ImageSink &sink);
+
+// decode from a seekable input stream
+int LoadImage(std::istream &is,
+              cocogfx::ePixelFormat format,
+              ImageSink &sink);
+
+// decoded image delivered by LoadImages
+struct LoadImageResult {
+  size_t index;                // position in the request list
+  int status;                  // 0 on success, -1 on failure
+  std::vector<uint8_t> pixels;
+  uint32_t width;
+  uint32_t height;
+};
+
+// called from the decode threads, possibly concurrently and out of order.
+// the pixels may be moved out of the result
+typedef std::function<void (const std::string& filename,
+                            LoadImageResult& result)> LoadImageCallback;
+
+// Batch decode: a reader thread loads the files in order while a pool of
+// decode threads converts them, a failed file does not stop the batch.
+// returns the number of files that failed
+int LoadImages(const std::vector<std::string>& filenames,
+               cocogfx::ePixelFormat format,
+               const LoadImageCallback& callback,
+               uint32_t num_threads = 0);
+
 int SaveImage(const char *filename,
               cocogfx::ePixelFormat format,
               const uint8_t* pixels,
               uint32_t width,
               uint32_t height,
-              int32_t pitch);
+              int32_t pitch,
+              const PNGOptions& png_options = PNGOptions());
+
+// encode into memory, the encoded bytes are appended to data
+int SaveImage(std::vector<uint8_t> &data,
+              eImageType type,
+              cocogfx::ePixelFormat format,
+              const uint8_t* pixels,
+              uint32_t width,
+              uint32_t height,
+              int32_t pitch,
+              const PNGOptions& png_options = PNGOptions());
+
+int SaveImage(std::ostream &os,
+              eImageType type,
+              cocogfx::ePixelFormat format,
+              const uint8_t* pixels,
+              uint32_t width,
+              uint32_t height,
+              int32_t pitch,
+              const PNGOptions& png_options = PNGOptions());
+
+// Streaming image encoder, the file type is selected from the extension.
+// Rows must be written top to bottom.
+class ImageWriter : public ImageSink {
+public:
+  ImageWriter(const char *filename,
+              const PNGOptions& png_options = PNGOptions());
+
+  ImageWriter(std::ostream &os,
+              eImageType type,
+              const PNGOptions& png_options = PNGOptions());
 
+  int begin(uint32_t width,
+            uint32_t height,
+            cocogfx::ePixelFormat format) override;
+
+  int writeRows(const uint8_t* rows,
+                uint32_t y,
+                uint32_t count,
+                int32_t pitch) override;
+
+  int finish() override;
+
+private:
+  std::unique_ptr<ImageSink> writer_;
+};
+
+// print each pixel as the hex value of its bpp little-endian bytes
 void DumpImage(const std::vector<uint8_t>& pixels,
                 uint32_t width,
                 uint32_t height,
                 uint32_t bpp);
 
+// text dump settings
+struct DumpOptions {
+  enum eMode {
+    DUMP_RAW,      // hex value of the packed pixel, e.g. f800
+    DUMP_CHANNELS, // 8-bit hex channels present in the format, e.g. ff:00:00
+  };
+
+  uint32_t mode;   // eMode
+  uint32_t x;      // region origin
+  uint32_t y;
+  uint32_t width;  // region size, 0 extends to the image edge
+  uint32_t height;
+
+  DumpOptions()
+    : mode(DUMP_RAW)
+    , x(0)
+    , y(0)
+    , width(0)
+    , height(0)
+  {}
+};
+
+// buffered text dump, one line per row with comma-separated pixels.
+// returns 0 on success, -1 on a write error
+int DumpImage(FILE* out,
+              const uint8_t* pixels,
+              cocogfx::ePixelFormat format,
+              uint32_t width,
+              uint32_t height,
+              int32_t pitch,
+              const DumpOptions& options = DumpOptions());
+
+int DumpImage(std::ostream &os,
+              const uint8_t* pixels,
+              cocogfx::ePixelFormat format,
+              uint32_t width,
+              uint32_t height,
+              int32_t pitch,
+              const DumpOptions& options = DumpOptions());
+
+// image comparison settings
+struct CompareOptions {
+  // perceptual metrics, can be combined
+  enum eMetric {
+    METRIC_SSIM    = 0x1, // structural similarity on luma, 11x11 gaussian window
+    METRIC_MS_SSIM = 0x2, // multi-scale SSIM over up to 5 scales
+    METRIC_DELTA_E = 0x4, // CIE76 color difference in L*a*b*
+  };
+
+  // diff image content
+  enum eDiffMode {
+    DIFF_NONE,
+    DIFF_ABSOLUTE, // per-channel absolute difference
+    DIFF_MASK,     // white where a channel exceeds the tolerance
+    DIFF_HEATMAP,  // false color of the largest channel difference
+  };
+
+  uint32_t tolerance;        // per-channel difference ignored
+  uint32_t max_errors;       // mismatch locations recorded, 0 records none
+  bool print_errors;         // print the recorded mismatches to stdout
+  uint32_t num_threads;      // worker threads, 0 uses all cores
+  uint32_t metrics;          // eMetric mask
+  uint32_t diff_mode;        // eDiffMode
+  const char* diff_filename; // diff image saved when images differ
+
+  CompareOptions()
+    : tolerance(0)
+    , max_errors(0)
+    , print_errors(false)
+    , num_threads(0)
+    , metrics(0)
+    , diff_mode(DIFF_NONE)
+    , diff_filename(nullptr)
+  {}
+};
+
+struct CompareMismatch {
+  uint32_t x;
+  uint32_t y;
+  ColorARGB first;
+  ColorARGB second;
+};
+
+// image comparison statistics, channel differences are measured on
+// 8-bit ARGB values over the channels present in the pixel format
+struct CompareResult {
+  uint32_t mismatches;           // pixels with a channel above tolerance
+  ColorARGB max_error;           // largest difference per channel
+  double mean_error;             // mean absolute channel difference
+  double psnr;                   // in dB, infinity for identical images
+  TRect<uint32_t> bounds;        // mismatch bounding box, right/bottom exclusive
+  // perceptual metrics, zero unless requested
+  double ssim;                   // 1 for identical images
+  double ms_ssim;                // 1 for identical images
+  double mean_delta_e;           // below 1 is not perceptible
+  double max_delta_e;
+  // first max_errors mismatches in row order
+  std::vector<CompareMismatch> errors;
+};
+
+// compare two image files decoded to the given format.
+// returns 0 on success, -1 if a file fails to load or sizes differ
+int CompareImages(const char* filename1,
+                  const char* filename2,
+                  cocogfx::ePixelFormat format,
+                  CompareResult &result,
+                  const CompareOptions& options = CompareOptions());
+
+// compare a pixel buffer against an image file decoded to the same format
+int CompareImages(const char* filename,
+                  const uint8_t* pixels,
+                  cocogfx::ePixelFormat format,
+                  uint32_t width,
+                  uint32_t height,
+                  int32_t pitch,
+                  CompareResult &result,
+                  const CompareOptions& options = CompareOptions());
+
+// compare two pixel buffers, no conversion is made when both are
+// A8R8G8B8 and identical rows are skipped when the formats match.
+// the images are compared on 8-bit ARGB values otherwise
+int CompareImages(const uint8_t* pixels1,
+                  cocogfx::ePixelFormat format1,
+                  uint32_t width1,
+                  uint32_t height1,
+                  int32_t pitch1,
+                  const uint8_t* pixels2,
+                  cocogfx::ePixelFormat format2,
+                  uint32_t width2,
+                  uint32_t height2,
+                  int32_t pitch2,
+                  CompareResult &result,
+                  const CompareOptions& options = CompareOptions());
+
+// returns the number of mismatches, up to max_errors (0 for no limit),
+// printing each one
 int CompareImages(const char* filename1,
                   const char* filename2,
                   cocogfx::ePixelFormat format,
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "common.hpp"
+#include <streambuf>
+#include <vector>
+
+namespace cocogfx {
+
+// Read-only stream buffer over a memory block, no copy is made.
+class MemoryStreamBuf : public std::streambuf {
+public:
+  MemoryStreamBuf(const uint8_t* data, size_t size) {
+    auto begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+    this->setg(begin, begin, begin + size);
+  }
+
+protected:
+  pos_type seekoff(off_type off,
+                   std::ios_base::seekdir dir,
+                   std::ios_base::openmode which = std::ios_base::in) override {
+    if (!(which & std::ios_base::in))
+      return pos_type(off_type(-1));
+    char* pos;
+    switch (dir) {
+    case std::ios_base::beg: pos = this->eback() + off; break;
+    case std::ios_base::cur: pos = this->gptr() + off; break;
+    case std::ios_base::end: pos = this->egptr() + off; break;
+    default: return pos_type(off_type(-1));
+    }
+    if (pos < this->eback() || pos > this->egptr())
+      return pos_type(off_type(-1));
+    this->setg(this->eback(), pos, this->egptr());
+    return pos_type(pos - this->eback());
+  }
+
+  pos_type seekpos(pos_type pos,
+                   std::ios_base::openmode which = std::ios_base::in) override {
+    return this->seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+};
+
+// Write-only stream buffer appending to a byte vector.
+class VectorStreamBuf : public std::streambuf {
+public:
+  VectorStreamBuf(std::vector<uint8_t>& data) : data_(data) {}
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof()))
+      return traits_type::not_eof(ch);
+    data_.push_back(static_cast<uint8_t>(ch));
+    return ch;
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    data_.insert(data_.end(), s, s + n);
+    return n;
+  }
+
+private:
+  std::vector<uint8_t>& data_;
+};
+
+}
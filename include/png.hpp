@@ -1,19 +1,139 @@
+#pragma once
+
 #include "common.hpp"
+#include "imagesink.hpp"
 #include <vector>
+#include <string>
+#include <fstream>
+#include <memory>
+
+struct png_struct_def;
+struct png_info_def;
 
 namespace cocogfx {
 
+// PNG encoder tuning, negative values keep the libpng defaults.
+struct PNGOptions {
+  // row filters, can be combined (same values as libpng)
+  enum eFilter {
+    FILTER_NONE  = 0x08,
+    FILTER_SUB   = 0x10,
+    FILTER_UP    = 0x20,
+    FILTER_AVG   = 0x40,
+    FILTER_PAETH = 0x80,
+    FILTER_ALL   = 0xf8,
+  };
+
+  // deflate strategy (same values as zlib)
+  enum eStrategy {
+    STRATEGY_DEFAULT      = 0,
+    STRATEGY_FILTERED     = 1,
+    STRATEGY_HUFFMAN_ONLY = 2,
+    STRATEGY_RLE          = 3,
+    STRATEGY_FIXED        = 4,
+  };
+
+  int compression_level;  // zlib level 0-9
+  int filters;            // eFilter mask
+  int strategy;           // eStrategy
+  int buffer_size;        // deflate output buffer size in bytes
+  int num_threads;        // stripe encoder threads, 0 uses all cores, 1 uses libpng
+
+  PNGOptions()
+    : compression_level(-1)
+    , filters(-1)
+    , strategy(-1)
+    , buffer_size(-1)
+    , num_threads(1)
+  {}
+
+  // fastest encoding, larger files
+  static PNGOptions Fast() {
+    PNGOptions options;
+    options.compression_level = 1;
+    options.filters = FILTER_SUB;
+    options.strategy = STRATEGY_RLE;
+    options.buffer_size = 256 * 1024;
+    return options;
+  }
+
+  // smallest files, slowest encoding
+  static PNGOptions Best() {
+    PNGOptions options;
+    options.compression_level = 9;
+    options.filters = FILTER_ALL;
+    options.strategy = STRATEGY_DEFAULT;
+    options.buffer_size = 256 * 1024;
+    return options;
+  }
+};
+
 int LoadPNG(const char *filename, 
             std::vector<uint8_t> &pixels,
             uint32_t *width,
             uint32_t *height,
             uint32_t *bpp);
 
+int LoadPNG(const char *filename, 
+            ImageSink &sink);
+
+int LoadPNG(std::istream &is, 
+            ImageSink &sink);
+
+// reads the IHDR chunk and the chunk headers preceding the image data
+int ProbePNG(std::istream &is, 
+             uint32_t *width,
+             uint32_t *height,
+             uint32_t *channels,
+             ePixelFormat *format);
+
 int SavePNG(const char *filename, 
             const uint8_t* pixels, 
             uint32_t width,
             uint32_t height, 
             uint32_t bpp,
-            int32_t pitch);
+            int32_t pitch,
+            const PNGOptions& options = PNGOptions());
+
+// Streaming PNG encoder, rows must be written top to bottom.
+// When options.num_threads != 1, rows are grouped into horizontal stripes
+// that are filtered and deflated on worker threads, then concatenated into
+// a single zlib stream.
+class PNGWriter : public ImageSink {
+public:
+  PNGWriter(const char *filename, 
+            const PNGOptions& options = PNGOptions());
+
+  PNGWriter(std::ostream &os, 
+            const PNGOptions& options = PNGOptions());
+
+  ~PNGWriter();
+
+  int begin(uint32_t width,
+            uint32_t height,
+            ePixelFormat format) override;
+
+  int writeRows(const uint8_t* rows,
+                uint32_t y,
+                uint32_t count,
+                int32_t pitch) override;
+
+  int finish() override;
+
+private:
+  class StripeEncoder;
+
+  void close();
+
+  std::string filename_;
+  PNGOptions options_;
+  std::ofstream ofs_;
+  std::ostream* os_;
+  png_struct_def* png_;
+  png_info_def* png_info_;
+  uint32_t height_;
+  uint32_t next_row_;
+  std::unique_ptr<StripeEncoder> stripes_;
+};
 
 }
\ No newline at end of file
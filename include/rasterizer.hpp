@@ -0,0 +1,83 @@
+#pragma once
+
+#include "cgltrace.hpp"
+#include <memory>
+#include <vector>
+
+namespace cocogfx {
+
+class WorkerPool;
+
+// Deterministic reference rasterizer replaying CGLTrace drawcalls.
+// Triangles are clipped in homogeneous space, snapped to 28.4 fixed-point
+// and scan-converted with half-space edge functions and a top-left fill
+// rule. Attributes are interpolated perspective-correct in a fixed order and
+// fragments are shaded with 8-bit integer math, so the same trace always
+// produces the same image.
+// The render targets follow the drawcall color and depth formats, their
+// content is converted when a drawcall switches format.
+// With several threads, drawcalls are batched: vertices are transformed in
+// parallel, triangles are binned into TILE_SIZE screen tiles and tiles are
+// rasterized on a work-stealing pool. Each tile draws its triangles in
+// submission order, so the output matches the serial path bit-for-bit.
+class CGLRasterizer {
+public:
+  struct surface_t {
+    ePixelFormat format;
+    uint32_t width;
+    uint32_t height;
+    int32_t pitch;
+    std::vector<uint8_t> pixels;
+  };
+
+  enum {
+    TILE_SIZE = 64,
+  };
+
+  // 0 uses all hardware threads, 1 is the serial path
+  explicit CGLRasterizer(uint32_t num_threads = 1);
+  ~CGLRasterizer();
+
+  // allocate the render targets, their content is cleared
+  int resize(uint32_t width, uint32_t height);
+
+  // color is A8R8G8B8, depth a 16-bit unorm value
+  void clear(uint32_t color = 0, uint16_t depth = 0xffff, uint8_t stencil = 0);
+
+  // texture is only sampled when texturing is enabled, null disables it
+  int draw(const CGLTrace::drawcall_t& drawcall,
+           const CGLTrace::texture_t* texture);
+
+  // clear and draw every drawcall in order, the render targets are sized
+  // to cover all viewports unless resize() was called before
+  int replay(const CGLTrace& trace);
+
+  const surface_t& colorBuffer() const {
+    return color_;
+  }
+
+  // FORMAT_D16 or FORMAT_X8S8D16
+  const surface_t& depthBuffer() const {
+    return depth_;
+  }
+
+private:
+  CGLRasterizer(const CGLRasterizer&);
+  CGLRasterizer& operator=(const CGLRasterizer&);
+
+  struct batch_entry_t {
+    const CGLTrace::drawcall_t* drawcall;
+    const CGLTrace::texture_t* texture;
+  };
+
+  int setFormats(const CGLTrace::states_t& states);
+
+  // the batch formats must match the render targets
+  int drawTiles(const std::vector<batch_entry_t>& batch);
+
+  surface_t color_;
+  surface_t depth_;
+  std::unique_ptr<WorkerPool> pool_; // null on the serial path
+};
+
+}
@@ -1,4 +1,8 @@
 #include "bmp.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 
 using namespace cocogfx;
@@ -51,13 +55,162 @@ struct __attribute__((__packed__)) BITMAPINFO {
 
 #endif
 
-int cocogfx::LoadBMP(const char */*filename*/, 
-                     std::vector<uint8_t> &/*pixels*/, 
-                     uint32_t */*width*/,
-                     uint32_t */*height*/,
-                     uint32_t */*bpp*/) {        
-  std::abort();
-  return -1;
+int cocogfx::LoadBMP(const char *filename, 
+                     std::vector<uint8_t> &pixels, 
+                     uint32_t *width,
+                     uint32_t *height,
+                     uint32_t *bpp) {        
+  ImageBufferSink sink(pixels);
+  int ret = LoadBMP(filename, sink);
+  if (ret)
+    return ret;
+
+  *width  = sink.width();
+  *height = sink.height();
+  *bpp    = Format::GetInfo(sink.format()).BytePerPixel;
+
+  return 0;
+}
+
+int cocogfx::LoadBMP(const char *filename, 
+                     ImageSink &sink) {
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  return LoadBMP(ifs, sink);
+}
+
+namespace {
+
+struct bmp_header_t {
+  uint32_t width;
+  uint32_t height;
+  uint32_t bitcount;
+  uint32_t offset;
+  bool bottom_up;
+  ePixelFormat format;
+};
+
+int read_header(std::istream &is, bmp_header_t* out) {
+  BITMAPFILEHEADER header;
+  BITMAPINFOHEADER info;
+  if (!is.read(reinterpret_cast<char*>(&header), sizeof(BITMAPFILEHEADER))
+   || header.bfType != BF_TYPE
+   || !is.read(reinterpret_cast<char*>(&info), sizeof(BITMAPINFOHEADER))
+   || info.biSize < sizeof(BITMAPINFOHEADER)) {
+    std::cerr << "invalid BMP file header!" << std::endl;
+    return -1;
+  }
+
+  // color masks follow the base info header
+  uint32_t masks[3] = {0, 0, 0};
+  if (BI_BITFIELDS == info.biCompression
+   && !is.read(reinterpret_cast<char*>(masks), sizeof(masks))) {
+    std::cerr << "invalid BMP file header!" << std::endl;
+    return -1;
+  }
+
+  ePixelFormat format = FORMAT_UNKNOWN;
+  if (16 == info.biBitCount
+   && BI_BITFIELDS == info.biCompression
+   && 0xF800 == masks[0] && 0x07E0 == masks[1] && 0x001F == masks[2]) {
+    format = FORMAT_R5G6B5;
+  } else
+  if (24 == info.biBitCount && BI_RGB == info.biCompression) {
+    format = FORMAT_R8G8B8;
+  } else
+  if (32 == info.biBitCount 
+   && (BI_RGB == info.biCompression
+    || (BI_BITFIELDS == info.biCompression
+     && 0xFF0000 == masks[0] && 0xFF00 == masks[1] && 0xFF == masks[2]))) {
+    format = FORMAT_A8R8G8B8;
+  } else {
+    std::cerr << "unsupported BMP encoding format!" << std::endl;
+    return -1;
+  }
+
+  // rows are stored bottom-up unless the height is negative
+  out->width     = std::abs(info.biWidth);
+  out->height    = std::abs(info.biHeight);
+  out->bitcount  = info.biBitCount;
+  out->offset    = header.bfOffBits;
+  out->bottom_up = (info.biHeight > 0);
+  out->format    = format;
+
+  return 0;
+}
+
+}
+
+int cocogfx::ProbeBMP(std::istream &is, 
+                      uint32_t *width,
+                      uint32_t *height,
+                      uint32_t *channels,
+                      ePixelFormat *format) {
+  bmp_header_t header;
+  int ret = read_header(is, &header);
+  if (ret)
+    return ret;
+
+  *width  = header.width;
+  *height = header.height;
+  *channels = (header.bitcount == 32) ? 4 : 3;
+  *format = header.format;
+
+  return 0;
+}
+
+int cocogfx::LoadBMP(std::istream &is, 
+                     ImageSink &sink) {
+  auto start = is.tellg();
+
+  bmp_header_t header;
+  int ret = read_header(is, &header);
+  if (ret)
+    return ret;
+
+  auto data_start = start + std::streamoff(header.offset);
+  if (!is.seekg(data_start)) {
+    std::cerr << "invalid BMP file!" << std::endl;
+    return -1;
+  }
+
+  bool bottom_up  = header.bottom_up;
+  uint32_t width  = header.width;
+  uint32_t height = header.height;
+
+  ret = sink.begin(width, height, header.format);
+  if (ret)
+    return ret;
+
+  // rows are padded to 4 bytes
+  uint32_t pitch = ((width * (header.bitcount / 8)) + 3) & ~3;
+  uint32_t band_rows = GetBandRows(pitch);
+  std::vector<uint8_t> rows(band_rows * pitch);
+  // bands are sent top to bottom
+  for (uint32_t i = 0; i < height; i += band_rows) {
+    uint32_t count = std::min(band_rows, height - i);
+    if (bottom_up
+     && !is.seekg(data_start + std::streamoff(height - i - count) * pitch)) {
+      std::cerr << "invalid BMP file!" << std::endl;
+      return -1;
+    }
+    if (!is.read(reinterpret_cast<char*>(rows.data()), count * pitch)) {
+      std::cerr << "invalid BMP file!" << std::endl;
+      return -1;
+    }
+    if (bottom_up) {
+      ret = sink.writeRows(rows.data() + (count - 1) * pitch, i, count, -(int32_t)pitch);
+    } else {
+      ret = sink.writeRows(rows.data(), i, count, pitch);
+    }
+    if (ret)
+      return ret;
+  }
+
+  return sink.finish();
 }
 
 int cocogfx::SaveBMP(const char *filename, 
@@ -66,6 +219,40 @@ int cocogfx::SaveBMP(const char *filename,
                      uint32_t height, 
                      uint32_t bpp,
                      int32_t pitch) {
+  BMPWriter writer(filename);
+  int ret = writer.begin(width, height, GetImageFormat(bpp));
+  if (ret)
+    return ret;
+
+  ret = writer.writeRows(pixels, 0, height, pitch);
+  if (ret)
+    return ret;
+
+  return writer.finish();
+}
+
+BMPWriter::BMPWriter(const char *filename)
+  : filename_(filename)
+  , os_(nullptr)
+  , width_(0)
+  , bpp_(0)
+  , height_(0)
+  , next_row_(0)
+{}
+
+BMPWriter::BMPWriter(std::ostream &os)
+  : os_(&os)
+  , width_(0)
+  , bpp_(0)
+  , height_(0)
+  , next_row_(0)
+{}
+
+int BMPWriter::begin(uint32_t width,
+                     uint32_t height, 
+                     ePixelFormat format) {
+  uint32_t bpp = Format::GetInfo(format).BytePerPixel;
+
   BITMAPFILEHEADER header;
   header.bfSize = 0;
   header.bfType = BF_TYPE;
@@ -78,9 +265,10 @@ int cocogfx::SaveBMP(const char *filename,
     uint32_t bmiColors[3];
   } bmp_info;  
 
+  // rows are written top-down
   bmp_info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
   bmp_info.bmiHeader.biWidth = width;
-  bmp_info.bmiHeader.biHeight = -height;
+  bmp_info.bmiHeader.biHeight = -(int32_t)height;
   bmp_info.bmiHeader.biPlanes = 1;
   bmp_info.bmiHeader.biXPelsPerMeter = 0;
   bmp_info.bmiHeader.biYPelsPerMeter = 0;
@@ -96,63 +284,88 @@ int cocogfx::SaveBMP(const char *filename,
     bmp_info.bmiColors[1] = 0x07E0;
     bmp_info.bmiColors[2] = 0x001F;
     infoSize = sizeof(bmp_info_header_t);
-  }
+  } else
   if (3 == bpp || 4 == bpp) {
     bmp_info.bmiHeader.biBitCount = 24;
     bmp_info.bmiHeader.biCompression = BI_RGB;
     infoSize = sizeof(BITMAPINFOHEADER);
   } else {
+    std::cerr << "unsupported pixel stride: " << bpp << "!" << std::endl;
     return -1;
   }
 
-  bmp_info.bmiHeader.biSizeImage = height *
-                                   bmp_info.bmiHeader.biWidth *
-                                   (bmp_info.bmiHeader.biBitCount / 8);
+  // rows are padded to 4 bytes
+  uint32_t row_size = ((width * (bmp_info.bmiHeader.biBitCount / 8)) + 3) & ~3;
+
+  bmp_info.bmiHeader.biSizeImage = height * row_size;
   header.bfOffBits = sizeof(BITMAPFILEHEADER) + infoSize;
   header.bfSize = header.bfOffBits + bmp_info.bmiHeader.biSizeImage;
 
-  auto pBits = pixels;
-
-  if (pitch < 0) {
-    bmp_info.bmiHeader.biHeight *= -1;
-    int32_t offset = pitch * (height - 1);
-    pBits += offset;
+  if (nullptr == os_) {
+    ofs_.open(filename_.c_str(), std::ios::out | std::ios::binary);
+    if (!ofs_.is_open()) {
+      std::cerr << "couldn't open file: " << filename_ << "!" << std::endl;
+      return -1;
+    }
+    os_ = &ofs_;
   }
 
-  auto pFile = fopen(filename, "w");
-  if (nullptr == pFile) {
-    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+  if (!os_->write(reinterpret_cast<const char*>(&header), sizeof(BITMAPFILEHEADER))
+   || !os_->write(reinterpret_cast<const char*>(&bmp_info), infoSize)) {
     return -1;
   }
 
-  if (fwrite(&header, 1, sizeof(BITMAPFILEHEADER), pFile) !=
-      sizeof(BITMAPFILEHEADER)) {
-    fclose(pFile);
-    return -1;
-  }
+  row_.assign(row_size, 0);
+  width_    = width;
+  bpp_      = bpp;
+  height_   = height;
+  next_row_ = 0;
 
-  if (fwrite(&bmp_info, 1, infoSize, pFile) != infoSize) {
-    fclose(pFile);
+  return 0;
+}
+
+int BMPWriter::writeRows(const uint8_t* rows, 
+                         uint32_t y, 
+                         uint32_t count, 
+                         int32_t pitch) {
+  if (nullptr == os_ || y != next_row_ || y + count > height_) {
+    std::cerr << "out of order BMP rows!" << std::endl;
     return -1;
   }
 
-  if (4 == bpp) {
-    for (uint32_t offset = 0; offset < bmp_info.bmiHeader.biSizeImage;
-         offset += 3) {
-      if (fwrite(pBits + (4 * (offset / 3)), 1, 3, pFile) != 3) {
-        fclose(pFile);
-        return -1;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (4 == bpp_) {
+      // drop the alpha channel
+      auto dst = row_.data();
+      for (uint32_t x = 0; x < width_; ++x) {
+        dst[0] = rows[4 * x + 0];
+        dst[1] = rows[4 * x + 1];
+        dst[2] = rows[4 * x + 2];
+        dst += 3;
       }
+    } else {
+      memcpy(row_.data(), rows, width_ * bpp_);
     }
-  } else {
-    if (fwrite(pBits, 1, bmp_info.bmiHeader.biSizeImage, pFile) !=
-        bmp_info.bmiHeader.biSizeImage) {
-      fclose(pFile);
+    if (!os_->write(reinterpret_cast<const char*>(row_.data()), row_.size()))
       return -1;
-    }
+    rows += pitch;
   }
-
-  fclose(pFile);  
+  next_row_ += count;
 
   return 0;  
-}
\ No newline at end of file
+}
+
+int BMPWriter::finish() {
+  if (nullptr == os_ || next_row_ != height_) {
+    std::cerr << "incomplete BMP image!" << std::endl;
+    return -1;
+  }
+
+  if (os_ == &ofs_) {
+    ofs_.close();
+  } else {
+    os_->flush();
+  }
+
+  return os_->fail() ? -1 : 0;
+}
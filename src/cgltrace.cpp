@@ -1,4 +1,8 @@
 #include "cgltrace.hpp"
+#include "cgltracefile.hpp"
+#include "imagehash.hpp"
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <string.h>
 
@@ -10,6 +14,15 @@
 
 using namespace cocogfx;
 
+uint64_t CGLTrace::texture_t::computeHash() const {
+  if (format >= FORMAT_COLOR_SIZE_)
+    return 0;
+  uint32_t pitch = width * Format::GetInfo(format).BytePerPixel;
+  if (pixels.size() != size_t(pitch) * height)
+    return 0; // malformed textures share a bucket, operator== still decides
+  return HashImage(pixels.data(), format, width, height, pitch);
+}
+
 bool CGLTrace::texture_t::operator==(const CGLTrace::texture_t& rhs) const {
   return (format == rhs.format) 
       && (width == rhs.width)
@@ -18,6 +31,88 @@ bool CGLTrace::texture_t::operator==(const CGLTrace::texture_t& rhs) const {
       && (0 == memcmp(pixels.data(), rhs.pixels.data(), pixels.size()));
 }
 
+static bool same_color(const CGLTrace::color_t& lhs, const CGLTrace::color_t& rhs) {
+  return (lhs.r == rhs.r)
+      && (lhs.g == rhs.g)
+      && (lhs.b == rhs.b)
+      && (lhs.a == rhs.a);
+}
+
+bool CGLTrace::states_t::operator==(const CGLTrace::states_t& rhs) const {
+  return (color_enabled == rhs.color_enabled)
+      && (color_format == rhs.color_format)
+      && (color_writemask == rhs.color_writemask)
+      && (depth_test == rhs.depth_test)
+      && (depth_writemask == rhs.depth_writemask)
+      && (depth_format == rhs.depth_format)
+      && (depth_func == rhs.depth_func)
+      && (stencil_test == rhs.stencil_test)
+      && (stencil_func == rhs.stencil_func)
+      && (stencil_zpass == rhs.stencil_zpass)
+      && (stencil_zfail == rhs.stencil_zfail)
+      && (stencil_fail == rhs.stencil_fail)
+      && (stencil_ref == rhs.stencil_ref)
+      && (stencil_mask == rhs.stencil_mask)
+      && (stencil_writemask == rhs.stencil_writemask)
+      && (texture_enabled == rhs.texture_enabled)
+      && same_color(texture_envcolor, rhs.texture_envcolor)
+      && (texture_envmode == rhs.texture_envmode)
+      && (texture_minfilter == rhs.texture_minfilter)
+      && (texture_magfilter == rhs.texture_magfilter)
+      && (texture_addressU == rhs.texture_addressU)
+      && (texture_addressV == rhs.texture_addressV)
+      && (blend_enabled == rhs.blend_enabled)
+      && (blend_src == rhs.blend_src)
+      && (blend_dst == rhs.blend_dst);
+}
+
+// field-wise so struct padding does not affect the hash
+static uint64_t hash_states(const CGLTrace::states_t& states) {
+  Hasher64 hasher;
+  auto add = [&](uint32_t value) {
+    hasher.update(&value, sizeof(value));
+  };
+  add(states.color_enabled);
+  add(states.color_format);
+  add(states.color_writemask);
+  add(states.depth_test);
+  add(states.depth_writemask);
+  add(states.depth_format);
+  add(states.depth_func);
+  add(states.stencil_test);
+  add(states.stencil_func);
+  add(states.stencil_zpass);
+  add(states.stencil_zfail);
+  add(states.stencil_fail);
+  add(states.stencil_ref);
+  add(states.stencil_mask);
+  add(states.stencil_writemask);
+  add(states.texture_enabled);
+  hasher.update(&states.texture_envcolor, sizeof(states.texture_envcolor));
+  add(states.texture_envmode);
+  add(states.texture_minfilter);
+  add(states.texture_magfilter);
+  add(states.texture_addressU);
+  add(states.texture_addressV);
+  add(states.blend_enabled);
+  add(states.blend_src);
+  add(states.blend_dst);
+  return hasher.digest();
+}
+
+uint32_t CGLTrace::StateTable::intern(const CGLTrace::states_t& states) {
+  auto hash = hash_states(states);
+  auto range = lookup_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (states_[it->second] == states)
+      return it->second;
+  }
+  uint32_t id = states_.size();
+  states_.push_back(states);
+  lookup_.emplace(hash, id);
+  return id;
+}
+
 namespace boost {
 namespace serialization {
 
@@ -127,12 +222,37 @@ void serialize(Archive & ar, CGLTrace::states_t & states, const unsigned int) {
 }
 
 template <class Archive>
-void serialize(Archive & ar, CGLTrace::drawcall_t & drawcall, const unsigned int) {
-  ar & make_nvp("states", drawcall.states);
-  ar & make_nvp("texture_id", drawcall.texture_id);
-  ar & make_nvp("vertices", drawcall.vertices);
-  ar & make_nvp("primitives", drawcall.primitives);
-  ar & make_nvp("viewport", drawcall.viewport);
+void save(Archive & ar, const CGLTrace::drawcall_t & drawcall, const unsigned int) {
+  ar << make_nvp("states", drawcall.states);
+  ar << make_nvp("texture_id", drawcall.texture_id);
+  ar << make_nvp("vertices", drawcall.vertices);
+  ar << make_nvp("primitives", drawcall.primitives);
+  ar << make_nvp("viewport", drawcall.viewport);
+}
+
+template <class Archive>
+void load(Archive & ar, CGLTrace::drawcall_t & drawcall, const unsigned int file_version) {
+  ar >> make_nvp("states", drawcall.states);
+  ar >> make_nvp("texture_id", drawcall.texture_id);
+  if (file_version < 1) {
+    // sparse vertices from older traces
+    std::unordered_map<uint32_t, CGLTrace::vertex_t> vertices;
+    ar >> make_nvp("vertices", vertices);
+    ar >> make_nvp("primitives", drawcall.primitives);
+    if (CGLTrace::CompactVertices(vertices, &drawcall)) {
+      throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+    }
+  } else {
+    ar >> make_nvp("vertices", drawcall.vertices);
+    ar >> make_nvp("primitives", drawcall.primitives);
+  }
+  ar >> make_nvp("viewport", drawcall.viewport);
+}
+
+template <class Archive>
+void serialize(Archive & ar, CGLTrace::drawcall_t & drawcall, const unsigned int file_version) {
+  boost::serialization::split_free(ar, drawcall, file_version);
 }
 
 template <class Archive>
@@ -144,13 +264,140 @@ void serialize(Archive & ar, CGLTrace & trace, const unsigned int) {
 }}
 
 BOOST_CLASS_VERSION(CGLTrace, 1)
+BOOST_CLASS_VERSION(CGLTrace::drawcall_t, 1)
+
+int CGLTrace::load(const char* filename, load_stats_t* stats) {
+  auto start = std::chrono::steady_clock::now();
+
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
+  }
+
+  uint8_t magic[4] = {0, 0, 0, 0};
+  ifs.read(reinterpret_cast<char*>(magic), sizeof(magic));
+  ifs.close();
+
+  int ret;
+  uint64_t file_size = 0;
+  uint32_t value = magic[0] | (magic[1] << 8) | (magic[2] << 16) | (uint32_t(magic[3]) << 24);
+  if (value == TraceFile::MAGIC) {
+    ret = this->loadBinary(filename, &file_size);
+  } else {
+    ret = this->loadXML(filename, &file_size);
+  }
+
+  if (0 == ret && stats) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    stats->file_size  = file_size;
+    stats->seconds    = elapsed.count();
+    stats->throughput = elapsed.count() > 0 ? (file_size / (1024.0 * 1024.0)) / elapsed.count() : 0;
+  }
+
+  return ret;
+}
+
+int CGLTrace::save(const char* filename,
+                   eArchive archive,
+                   eCompression compression) {
+  switch (archive) {
+  case ARCHIVE_BINARY:
+    return this->saveBinary(filename, compression);
+  case ARCHIVE_XML:
+    return this->saveXML(filename);
+  default:
+    std::cerr << "invalid archive type: " << archive << "!" << std::endl;
+    return -1;
+  }
+}
+
+int CGLTrace::Convert(const char* src_filename,
+                      const char* dst_filename,
+                      eArchive archive,
+                      eCompression compression) {
+  CGLTrace trace;
+  int ret = trace.load(src_filename);
+  if (ret)
+    return ret;
+  return trace.save(dst_filename, archive, compression);
+}
+
+size_t CGLTrace::dedupTextures() {
+  // visit ids in order so the lowest id of a group is kept
+  std::vector<uint32_t> ids;
+  ids.reserve(textures.size());
+  for (auto& texture : textures) {
+    ids.push_back(texture.first);
+  }
+  std::sort(ids.begin(), ids.end());
+
+  std::unordered_multimap<uint64_t, uint32_t> unique;
+  std::unordered_map<uint32_t, uint32_t> remap;
+  for (auto id : ids) {
+    auto& texture = textures[id];
+    auto hash = texture.computeHash();
+    auto range = unique.equal_range(hash);
+    auto it = range.first;
+    while (it != range.second && !(textures[it->second] == texture)) {
+      ++it;
+    }
+    if (it != range.second) {
+      remap[id] = it->second;
+    } else {
+      unique.emplace(hash, id);
+    }
+  }
+
+  if (remap.empty())
+    return 0;
+
+  for (auto& drawcall : drawcalls) {
+    auto it = remap.find(drawcall.texture_id);
+    if (it != remap.end()) {
+      drawcall.texture_id = it->second;
+    }
+  }
+  for (auto& alias : remap) {
+    textures.erase(alias.first);
+  }
+
+  return remap.size();
+}
+
+int CGLTrace::CompactVertices(const std::unordered_map<uint32_t, vertex_t>& vertices,
+                              drawcall_t* drawcall) {
+  std::unordered_map<uint32_t, uint32_t> remap;
+  remap.reserve(vertices.size());
+  drawcall->vertices.clear();
+  drawcall->vertices.reserve(vertices.size());
+  for (auto& primitive : drawcall->primitives) {
+    for (auto index : {&primitive.i0, &primitive.i1, &primitive.i2}) {
+      auto it = remap.find(*index);
+      if (it == remap.end()) {
+        auto vertex = vertices.find(*index);
+        if (vertex == vertices.end()) {
+          std::cerr << "invalid vertex index: " << *index << "!" << std::endl;
+          return -1;
+        }
+        it = remap.emplace(*index, drawcall->vertices.size()).first;
+        drawcall->vertices.push_back(vertex->second);
+      }
+      *index = it->second;
+    }
+  }
+  return 0;
+}
 
-int CGLTrace::load(const char* filename) {
+int CGLTrace::loadXML(const char* filename, uint64_t* file_size) {
   std::ifstream ifs(filename, std::ios::in | std::ios::binary);
   if (!ifs.is_open()) {
     std::cerr << "couldn't open file: " << filename << "!" << std::endl;
     return -1;
   }
+  ifs.seekg(0, std::ios::end);
+  *file_size = ifs.tellg();
+  ifs.seekg(0, std::ios::beg);
 
   try {
     boost::archive::xml_iarchive ia(ifs);
@@ -163,7 +410,7 @@ int CGLTrace::load(const char* filename) {
   return 0;
 }
 
-int CGLTrace::save(const char* filename) {
+int CGLTrace::saveXML(const char* filename) {
   std::ofstream ofs(filename, std::ios::out | std::ios::binary);
   if (!ofs.is_open()) {
     std::cerr << "couldn't create file: " << filename << "!" << std::endl;
@@ -0,0 +1,1219 @@
+#include "cgltrace.hpp"
+#include "cgltracefile.hpp"
+#include "workerpool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <lz4.h>
+#include <zlib.h>
+
+#if defined(_WIN32)
+#define COCOGFX_NO_MMAP
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace cocogfx;
+using namespace cocogfx::TraceFile;
+
+namespace {
+
+// Little-endian encoder into a byte buffer.
+class ByteWriter {
+public:
+  ByteWriter(std::vector<uint8_t>& buffer) : buffer_(buffer) {}
+
+  void u8(uint8_t value) {
+    buffer_.push_back(value);
+  }
+
+  void u32(uint32_t value) {
+    uint8_t bytes[4] = {
+      uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24)
+    };
+    buffer_.insert(buffer_.end(), bytes, bytes + 4);
+  }
+
+  void u64(uint64_t value) {
+    this->u32(uint32_t(value));
+    this->u32(uint32_t(value >> 32));
+  }
+
+  void i32(int32_t value) {
+    this->u32(uint32_t(value));
+  }
+
+  void f32(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    this->u32(bits);
+  }
+
+  void bytes(const void* data, size_t size) {
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    buffer_.insert(buffer_.end(), p, p + size);
+  }
+
+private:
+  std::vector<uint8_t>& buffer_;
+};
+
+// Little-endian decoder over a byte range, reads past the end fail.
+class ByteReader {
+public:
+  ByteReader(const uint8_t* data, size_t size)
+    : cur_(data)
+    , end_(data + size)
+    , failed_(false)
+  {}
+
+  uint8_t u8() {
+    if (!this->check(1))
+      return 0;
+    return *cur_++;
+  }
+
+  uint32_t u32() {
+    if (!this->check(4))
+      return 0;
+    uint32_t value = cur_[0] | (cur_[1] << 8) | (cur_[2] << 16) | (uint32_t(cur_[3]) << 24);
+    cur_ += 4;
+    return value;
+  }
+
+  uint64_t u64() {
+    uint64_t lo = this->u32();
+    uint64_t hi = this->u32();
+    return lo | (hi << 32);
+  }
+
+  int32_t i32() {
+    return int32_t(this->u32());
+  }
+
+  float f32() {
+    uint32_t bits = this->u32();
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+  }
+
+  const uint8_t* bytes(size_t size) {
+    if (!this->check(size))
+      return nullptr;
+    auto p = cur_;
+    cur_ += size;
+    return p;
+  }
+
+  size_t remaining() const {
+    return end_ - cur_;
+  }
+
+  bool failed() const {
+    return failed_;
+  }
+
+private:
+
+  bool check(size_t size) {
+    if (failed_ || size_t(end_ - cur_) < size) {
+      failed_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  const uint8_t* cur_;
+  const uint8_t* end_;
+  bool failed_;
+};
+
+void write_color(ByteWriter& w, const CGLTrace::color_t& color) {
+  w.f32(color.r);
+  w.f32(color.g);
+  w.f32(color.b);
+  w.f32(color.a);
+}
+
+CGLTrace::color_t read_color(ByteReader& r) {
+  CGLTrace::color_t color;
+  color.r = r.f32();
+  color.g = r.f32();
+  color.b = r.f32();
+  color.a = r.f32();
+  return color;
+}
+
+// changed-field bitmask followed by the changed fields, in declaration order
+void write_state_delta(ByteWriter& w,
+                       const CGLTrace::states_t& base,
+                       const CGLTrace::states_t& states) {
+  std::vector<uint8_t> fields;
+  ByteWriter fw(fields);
+  uint32_t mask = 0;
+  uint32_t bit = 0;
+  auto u8 = [&](uint8_t lhs, uint8_t rhs) {
+    if (lhs != rhs) {
+      mask |= 1u << bit;
+      fw.u8(rhs);
+    }
+    ++bit;
+  };
+  auto u32 = [&](uint32_t lhs, uint32_t rhs) {
+    if (lhs != rhs) {
+      mask |= 1u << bit;
+      fw.u32(rhs);
+    }
+    ++bit;
+  };
+  auto color = [&](const CGLTrace::color_t& lhs, const CGLTrace::color_t& rhs) {
+    if (memcmp(&lhs, &rhs, sizeof(CGLTrace::color_t))) {
+      mask |= 1u << bit;
+      write_color(fw, rhs);
+    }
+    ++bit;
+  };
+
+  u8(base.color_enabled, states.color_enabled);
+  u32(base.color_format, states.color_format);
+  u32(base.color_writemask, states.color_writemask);
+
+  u8(base.depth_test, states.depth_test);
+  u8(base.depth_writemask, states.depth_writemask);
+  u32(base.depth_format, states.depth_format);
+  u32(base.depth_func, states.depth_func);
+
+  u8(base.stencil_test, states.stencil_test);
+  u32(base.stencil_func, states.stencil_func);
+  u32(base.stencil_zpass, states.stencil_zpass);
+  u32(base.stencil_zfail, states.stencil_zfail);
+  u32(base.stencil_fail, states.stencil_fail);
+  u8(base.stencil_ref, states.stencil_ref);
+  u8(base.stencil_mask, states.stencil_mask);
+  u8(base.stencil_writemask, states.stencil_writemask);
+
+  u8(base.texture_enabled, states.texture_enabled);
+  color(base.texture_envcolor, states.texture_envcolor);
+  u32(base.texture_envmode, states.texture_envmode);
+  u32(base.texture_minfilter, states.texture_minfilter);
+  u32(base.texture_magfilter, states.texture_magfilter);
+  u32(base.texture_addressU, states.texture_addressU);
+  u32(base.texture_addressV, states.texture_addressV);
+
+  u8(base.blend_enabled, states.blend_enabled);
+  u32(base.blend_src, states.blend_src);
+  u32(base.blend_dst, states.blend_dst);
+
+  w.u32(mask);
+  w.bytes(fields.data(), fields.size());
+}
+
+void read_state_delta(ByteReader& r,
+                      const CGLTrace::states_t& base,
+                      CGLTrace::states_t& states) {
+  states = base;
+  uint32_t mask = r.u32();
+  uint32_t bit = 0;
+  auto changed = [&]() {
+    return (mask >> bit++) & 1;
+  };
+
+  if (changed()) states.color_enabled   = r.u8() != 0;
+  if (changed()) states.color_format    = ePixelFormat(r.u32());
+  if (changed()) states.color_writemask = r.u32();
+
+  if (changed()) states.depth_test      = r.u8() != 0;
+  if (changed()) states.depth_writemask = r.u8() != 0;
+  if (changed()) states.depth_format    = ePixelFormat(r.u32());
+  if (changed()) states.depth_func      = CGLTrace::ecompare(r.u32());
+
+  if (changed()) states.stencil_test      = r.u8() != 0;
+  if (changed()) states.stencil_func      = CGLTrace::ecompare(r.u32());
+  if (changed()) states.stencil_zpass     = CGLTrace::eStencilOp(r.u32());
+  if (changed()) states.stencil_zfail     = CGLTrace::eStencilOp(r.u32());
+  if (changed()) states.stencil_fail      = CGLTrace::eStencilOp(r.u32());
+  if (changed()) states.stencil_ref       = r.u8();
+  if (changed()) states.stencil_mask      = r.u8();
+  if (changed()) states.stencil_writemask = r.u8();
+
+  if (changed()) states.texture_enabled   = r.u8() != 0;
+  if (changed()) states.texture_envcolor  = read_color(r);
+  if (changed()) states.texture_envmode   = CGLTrace::eEnvMode(r.u32());
+  if (changed()) states.texture_minfilter = CGLTrace::eTexFilter(r.u32());
+  if (changed()) states.texture_magfilter = CGLTrace::eTexFilter(r.u32());
+  if (changed()) states.texture_addressU  = CGLTrace::eTexAddress(r.u32());
+  if (changed()) states.texture_addressV  = CGLTrace::eTexAddress(r.u32());
+
+  if (changed()) states.blend_enabled = r.u8() != 0;
+  if (changed()) states.blend_src     = CGLTrace::eBlendOp(r.u32());
+  if (changed()) states.blend_dst     = CGLTrace::eBlendOp(r.u32());
+}
+
+void write_vertex(ByteWriter& w, const CGLTrace::vertex_t& vertex) {
+  w.f32(vertex.pos.x);
+  w.f32(vertex.pos.y);
+  w.f32(vertex.pos.z);
+  w.f32(vertex.pos.w);
+  write_color(w, vertex.color);
+  w.f32(vertex.texcoord.u);
+  w.f32(vertex.texcoord.v);
+}
+
+void read_vertex(ByteReader& r, CGLTrace::vertex_t& vertex) {
+  vertex.pos.x = r.f32();
+  vertex.pos.y = r.f32();
+  vertex.pos.z = r.f32();
+  vertex.pos.w = r.f32();
+  vertex.color = read_color(r);
+  vertex.texcoord.u = r.f32();
+  vertex.texcoord.v = r.f32();
+}
+
+void write_drawcall(ByteWriter& w, const CGLTrace::drawcall_t& drawcall, uint32_t state_id) {
+  w.u32(state_id);
+  w.u32(drawcall.texture_id);
+
+  w.i32(drawcall.viewport.left);
+  w.i32(drawcall.viewport.right);
+  w.i32(drawcall.viewport.top);
+  w.i32(drawcall.viewport.bottom);
+  w.f32(drawcall.viewport.near);
+  w.f32(drawcall.viewport.far);
+
+  w.u32(drawcall.vertices.size());
+  for (auto& vertex : drawcall.vertices) {
+    write_vertex(w, vertex);
+  }
+
+  w.u32(drawcall.primitives.size());
+  for (auto& primitive : drawcall.primitives) {
+    w.u32(primitive.i0);
+    w.u32(primitive.i1);
+    w.u32(primitive.i2);
+  }
+}
+
+int read_drawcall(ByteReader& r,
+                  const CGLTrace::StateTable& states,
+                  CGLTrace::drawcall_t& drawcall,
+                  uint32_t* state_id) {
+  *state_id = r.u32();
+  if (*state_id >= states.size())
+    return -1;
+  drawcall.states = states[*state_id];
+  drawcall.texture_id = r.u32();
+
+  drawcall.viewport.left   = r.i32();
+  drawcall.viewport.right  = r.i32();
+  drawcall.viewport.top    = r.i32();
+  drawcall.viewport.bottom = r.i32();
+  drawcall.viewport.near   = r.f32();
+  drawcall.viewport.far    = r.f32();
+
+  // 40 bytes per vertex, 12 per primitive
+  uint32_t num_vertices = r.u32();
+  if (num_vertices > r.remaining() / 40)
+    return -1;
+  drawcall.vertices.resize(num_vertices);
+  for (auto& vertex : drawcall.vertices) {
+    read_vertex(r, vertex);
+  }
+
+  uint32_t num_primitives = r.u32();
+  if (num_primitives > r.remaining() / 12)
+    return -1;
+  drawcall.primitives.resize(num_primitives);
+  for (auto& primitive : drawcall.primitives) {
+    primitive.i0 = r.u32();
+    primitive.i1 = r.u32();
+    primitive.i2 = r.u32();
+  }
+
+  if (r.failed())
+    return -1;
+
+  for (auto& primitive : drawcall.primitives) {
+    if (primitive.i0 >= num_vertices
+     || primitive.i1 >= num_vertices
+     || primitive.i2 >= num_vertices)
+      return -1;
+  }
+
+  return 0;
+}
+
+// chunked compression, see the compressed payload layout in cgltracefile.hpp
+void compress_payload(const uint8_t* data,
+                      size_t size,
+                      uint32_t codec,
+                      int level,
+                      std::vector<uint8_t>& out) {
+  size_t num_chunks = (size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+  std::vector<std::vector<uint8_t>> chunks(num_chunks);
+  WorkerPool::Shared().run(num_chunks, [&](size_t i) {
+    size_t offset = i * COMPRESS_CHUNK_SIZE;
+    uLong raw_size = std::min<size_t>(COMPRESS_CHUNK_SIZE, size - offset);
+    uLongf stored_size;
+    bool compressed;
+    auto& chunk = chunks[i];
+    if (CODEC_LZ4 == codec) {
+      chunk.resize(LZ4_compressBound(raw_size));
+      stored_size = LZ4_compress_default(reinterpret_cast<const char*>(data + offset),
+                                         reinterpret_cast<char*>(chunk.data()),
+                                         raw_size, chunk.size());
+      compressed = (stored_size != 0);
+    } else {
+      stored_size = compressBound(raw_size);
+      chunk.resize(stored_size);
+      compressed = (Z_OK == compress2(chunk.data(), &stored_size, data + offset, raw_size, level));
+    }
+    if (!compressed || stored_size >= raw_size) {
+      // keep incompressible chunks raw
+      chunk.assign(data + offset, data + offset + raw_size);
+    } else {
+      chunk.resize(stored_size);
+    }
+  });
+
+  ByteWriter w(out);
+  w.u32(codec);
+  w.u32(num_chunks);
+  w.u64(size);
+  for (size_t i = 0; i < num_chunks; ++i) {
+    w.u32(std::min<size_t>(COMPRESS_CHUNK_SIZE, size - i * COMPRESS_CHUNK_SIZE));
+    w.u32(chunks[i].size());
+  }
+  for (auto& chunk : chunks) {
+    w.bytes(chunk.data(), chunk.size());
+  }
+}
+
+// compressed chunk with its destination in the decoded payload
+struct chunk_t {
+  uint32_t codec;
+  const uint8_t* src;
+  uint8_t* dst;
+  uint32_t raw_size;
+  uint32_t stored_size;
+};
+
+// size out to the decoded payload and append its chunks
+int parse_chunks(const uint8_t* data,
+                 size_t size,
+                 std::vector<uint8_t>& out,
+                 std::vector<chunk_t>* chunks) {
+  ByteReader r(data, size);
+  uint32_t codec = r.u32();
+  uint32_t num_chunks = r.u32();
+  uint64_t raw_size = r.u64();
+  if (r.failed()
+   || (codec != CODEC_DEFLATE && codec != CODEC_LZ4)
+   || num_chunks > r.remaining() / 8)
+    return -1;
+
+  size_t first = chunks->size();
+  chunks->resize(first + num_chunks);
+  uint64_t total_raw = 0;
+  uint64_t total_stored = 0;
+  for (size_t i = first; i < chunks->size(); ++i) {
+    auto& chunk = (*chunks)[i];
+    chunk.codec = codec;
+    chunk.raw_size = r.u32();
+    chunk.stored_size = r.u32();
+    total_raw += chunk.raw_size;
+    total_stored += chunk.stored_size;
+  }
+  if (r.failed() || total_raw != raw_size || total_stored > r.remaining()) {
+    chunks->resize(first);
+    return -1;
+  }
+
+  out.resize(raw_size);
+  auto src = r.bytes(total_stored);
+  auto dst = out.data();
+  for (size_t i = first; i < chunks->size(); ++i) {
+    auto& chunk = (*chunks)[i];
+    chunk.src = src;
+    chunk.dst = dst;
+    src += chunk.stored_size;
+    dst += chunk.raw_size;
+  }
+  return 0;
+}
+
+int decode_chunk(const chunk_t& chunk) {
+  if (chunk.stored_size == chunk.raw_size) {
+    memcpy(chunk.dst, chunk.src, chunk.raw_size);
+    return 0;
+  }
+  if (CODEC_LZ4 == chunk.codec) {
+    int dst_size = LZ4_decompress_safe(reinterpret_cast<const char*>(chunk.src),
+                                       reinterpret_cast<char*>(chunk.dst),
+                                       chunk.stored_size, chunk.raw_size);
+    return (dst_size == int(chunk.raw_size)) ? 0 : -1;
+  }
+  uLongf dst_size = chunk.raw_size;
+  if (Z_OK != uncompress(chunk.dst, &dst_size, chunk.src, chunk.stored_size)
+   || dst_size != chunk.raw_size)
+    return -1;
+  return 0;
+}
+
+int decompress_payload(const uint8_t* data,
+                       size_t size,
+                       std::vector<uint8_t>& out) {
+  std::vector<chunk_t> chunks;
+  if (parse_chunks(data, size, out, &chunks))
+    return -1;
+  std::atomic<int> failures(0);
+  WorkerPool::Shared().run(chunks.size(), [&](size_t i) {
+    if (decode_chunk(chunks[i])) {
+      ++failures;
+    }
+  });
+  return failures ? -1 : 0;
+}
+
+// section payload, decompressed into buffer when needed
+int decode_payload(const uint8_t* data,
+                   size_t size,
+                   uint32_t flags,
+                   std::vector<uint8_t>& buffer,
+                   const uint8_t** payload,
+                   size_t* payload_size) {
+  if (0 == (flags & SECTION_FLAG_COMPRESSED)) {
+    *payload = data;
+    *payload_size = size;
+    return 0;
+  }
+  if (decompress_payload(data, size, buffer))
+    return -1;
+  *payload = buffer.data();
+  *payload_size = buffer.size();
+  return 0;
+}
+
+// texture section header, pixels follow
+struct texture_header_t {
+  uint32_t id;
+  ePixelFormat format;
+  uint32_t width;
+  uint32_t height;
+  uint64_t size;
+};
+
+int read_texture_header(ByteReader& r, texture_header_t* header) {
+  header->id     = r.u32();
+  header->format = ePixelFormat(r.u32());
+  header->width  = r.u32();
+  header->height = r.u32();
+  header->size   = r.u64();
+  if (r.failed() || header->size > r.remaining())
+    return -1;
+  return 0;
+}
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+MappedFile::MappedFile()
+  : data_(nullptr)
+  , size_(0)
+{}
+
+MappedFile::~MappedFile() {
+  this->close();
+}
+
+int MappedFile::open(const char* filename) {
+  this->close();
+#ifdef COCOGFX_NO_MMAP
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  ifs.seekg(0, std::ios::end);
+  buffer_.resize(size_t(ifs.tellg()));
+  ifs.seekg(0, std::ios::beg);
+  if (!ifs.read(reinterpret_cast<char*>(buffer_.data()), buffer_.size())) {
+    std::cerr << "couldn't read file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#else
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || 0 == st.st_size) {
+    std::cerr << "couldn't read file: " << filename << "!" << std::endl;
+    ::close(fd);
+    return -1;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "couldn't map file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  data_ = reinterpret_cast<const uint8_t*>(data);
+  size_ = st.st_size;
+#endif
+  return 0;
+}
+
+void MappedFile::close() {
+#ifndef COCOGFX_NO_MMAP
+  if (data_) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+#endif
+  std::vector<uint8_t>().swap(buffer_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CGLTraceReader::CGLTraceReader() {}
+
+CGLTraceReader::~CGLTraceReader() {}
+
+int CGLTraceReader::open(const char* filename) {
+  this->close();
+
+  if (file_.open(filename))
+    return -1;
+
+  ByteReader r(file_.data(), file_.size());
+  uint32_t magic = r.u32();
+  uint32_t version = r.u32();
+  if (r.failed() || magic != MAGIC || version != VERSION) {
+    std::cerr << "unsupported trace file: " << filename << "!" << std::endl;
+    this->close();
+    return -1;
+  }
+  int ret = this->buildIndex();
+  if (0 == ret) {
+    ret = this->decodeStates();
+  }
+  if (ret) {
+    std::cerr << "invalid trace file: " << filename << "!" << std::endl;
+    this->close();
+    return -1;
+  }
+
+  return 0;
+}
+
+void CGLTraceReader::close() {
+  this->clearSections();
+  file_.close();
+}
+
+void CGLTraceReader::clearSections() {
+  drawcalls_.clear();
+  textures_.clear();
+  aliases_.clear();
+  texture_ids_.clear();
+  state_sections_.clear();
+  states_.clear();
+}
+
+int CGLTraceReader::addSection(uint32_t tag, uint32_t id, uint64_t offset) {
+  if (offset > file_.size() || file_.size() - offset < SECTION_HEADER_SIZE)
+    return -1;
+  ByteReader r(file_.data() + offset, SECTION_HEADER_SIZE);
+  if (r.u32() != tag)
+    return -1;
+  uint32_t flags = r.u32();
+  uint64_t size = r.u64();
+  if (size > file_.size() - offset - SECTION_HEADER_SIZE)
+    return -1;
+
+  section_t section;
+  section.data  = file_.data() + offset + SECTION_HEADER_SIZE;
+  section.size  = size;
+  section.flags = flags;
+  if (tag == SECTION_TEXTURE) {
+    if (!aliases_.count(id) && textures_.emplace(id, section).second) {
+      texture_ids_.push_back(id);
+    }
+  } else if (tag == SECTION_ALIAS) {
+    std::vector<uint8_t> buffer;
+    const uint8_t* payload;
+    size_t payload_size;
+    if (decode_payload(section.data, section.size, section.flags,
+                       buffer, &payload, &payload_size))
+      return -1;
+    ByteReader ar(payload, payload_size);
+    ar.u32();
+    uint32_t target = ar.u32();
+    if (ar.failed())
+      return -1;
+    if (!textures_.count(id) && aliases_.emplace(id, target).second) {
+      texture_ids_.push_back(id);
+    }
+  } else if (tag == SECTION_DRAWCALL) {
+    if (id != drawcalls_.size())
+      return -1;
+    drawcalls_.push_back(section);
+  } else if (tag == SECTION_STATES) {
+    state_sections_.push_back(section);
+  }
+  return 0;
+}
+
+int CGLTraceReader::decodeStates() {
+  // batches are written in id order, each entry is a delta to the previous
+  CGLTrace::states_t states;
+  memset(&states, 0, sizeof(states));
+  for (auto& section : state_sections_) {
+    std::vector<uint8_t> buffer;
+    const uint8_t* payload;
+    size_t payload_size;
+    if (decode_payload(section.data, section.size, section.flags,
+                       buffer, &payload, &payload_size))
+      return -1;
+    ByteReader r(payload, payload_size);
+    uint32_t first_id = r.u32();
+    uint32_t count = r.u32();
+    if (r.failed() || first_id != states_.size() || count > r.remaining() / 4)
+      return -1;
+    for (uint32_t i = 0; i < count; ++i) {
+      read_state_delta(r, states, states);
+      if (r.failed() || states_.intern(states) != first_id + i)
+        return -1;
+    }
+  }
+  state_sections_.clear();
+  return 0;
+}
+
+int CGLTraceReader::buildIndex() {
+  // END section with the index offset closes the file
+  size_t end_size = SECTION_HEADER_SIZE + 8;
+  if (file_.size() < FILE_HEADER_SIZE + end_size)
+    return -1;
+  ByteReader er(file_.data() + file_.size() - end_size, end_size);
+  uint32_t tag = er.u32();
+  er.u32();
+  uint64_t size = er.u64();
+  uint64_t index_offset = er.u64();
+  if (tag != SECTION_END || size != 8)
+    return -1;
+  if (index_offset > file_.size() - end_size
+   || file_.size() - end_size - index_offset < SECTION_HEADER_SIZE + 4)
+    return -1;
+
+  ByteReader r(file_.data() + index_offset, file_.size() - end_size - index_offset);
+  if (r.u32() != SECTION_INDEX)
+    return -1;
+  r.u32();
+  r.u64();
+  uint32_t count = r.u32();
+  if (count > r.remaining() / INDEX_ENTRY_SIZE)
+    return -1;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t entry_tag = r.u32();
+    uint32_t entry_id = r.u32();
+    uint64_t entry_offset = r.u64();
+    if (this->addSection(entry_tag, entry_id, entry_offset)) {
+      this->clearSections();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int CGLTraceReader::getDrawcall(size_t index,
+                                CGLTrace::drawcall_t* drawcall,
+                                uint32_t* state_id) const {
+  if (index >= drawcalls_.size())
+    return -1;
+  auto& section = drawcalls_[index];
+  std::vector<uint8_t> buffer;
+  const uint8_t* payload;
+  size_t payload_size;
+  if (decode_payload(section.data, section.size, section.flags,
+                     buffer, &payload, &payload_size))
+    return -1;
+  ByteReader r(payload, payload_size);
+  uint32_t id;
+  if (read_drawcall(r, states_, *drawcall, &id))
+    return -1;
+  if (state_id) {
+    *state_id = id;
+  }
+  return 0;
+}
+
+int CGLTraceReader::getTextureView(uint32_t id, texture_view_t* view) const {
+  auto alias = aliases_.find(id);
+  if (alias != aliases_.end()) {
+    id = alias->second;
+  }
+  auto it = textures_.find(id);
+  if (it == textures_.end())
+    return -1;
+  auto& section = it->second;
+  const uint8_t* payload;
+  size_t payload_size;
+  view->buffer.reset();
+  if (section.flags & SECTION_FLAG_COMPRESSED) {
+    view->buffer = std::make_shared<std::vector<uint8_t>>();
+  }
+  std::vector<uint8_t> unused;
+  if (decode_payload(section.data, section.size, section.flags,
+                     view->buffer ? *view->buffer : unused,
+                     &payload, &payload_size))
+    return -1;
+  ByteReader r(payload, payload_size);
+  texture_header_t header;
+  if (read_texture_header(r, &header))
+    return -1;
+  view->format = header.format;
+  view->width  = header.width;
+  view->height = header.height;
+  view->size   = header.size;
+  view->pixels = r.bytes(header.size);
+  return 0;
+}
+
+int CGLTraceReader::getTexture(uint32_t id, CGLTrace::texture_t* texture) const {
+  texture_view_t view;
+  if (this->getTextureView(id, &view))
+    return -1;
+  texture->format = view.format;
+  texture->width  = view.width;
+  texture->height = view.height;
+  texture->pixels.assign(view.pixels, view.pixels + view.size);
+  return 0;
+}
+
+int CGLTraceReader::readTrace(CGLTrace* trace) const {
+  struct job_t {
+    const section_t* section;
+    CGLTrace::texture_t* texture;   // texture section
+    CGLTrace::drawcall_t* drawcall; // drawcall section
+    std::vector<uint8_t> buffer;    // decompressed payload
+  };
+
+  trace->drawcalls.clear();
+  trace->textures.clear();
+
+  // create the entries up front so workers never modify the containers
+  std::vector<job_t> jobs;
+  jobs.reserve(texture_ids_.size() + drawcalls_.size());
+  for (auto id : texture_ids_) {
+    if (aliases_.count(id))
+      continue;
+    jobs.push_back({&textures_.at(id), &trace->textures[id], nullptr, {}});
+  }
+  trace->drawcalls.resize(drawcalls_.size());
+  for (size_t i = 0; i < drawcalls_.size(); ++i) {
+    jobs.push_back({&drawcalls_[i], nullptr, &trace->drawcalls[i], {}});
+  }
+
+  // Batches bound the decompressed payloads held at once. The chunks of
+  // every compressed section in a batch are decoded as one work list, then
+  // the sections themselves.
+  auto& pool = WorkerPool::Shared();
+  std::atomic<int> failures(0);
+  for (size_t begin = 0; begin < jobs.size() && !failures;) {
+    std::vector<chunk_t> chunks;
+    uint64_t batch_size = 0;
+    size_t end = begin;
+    for (; end < jobs.size() && batch_size < READER_BATCH_SIZE; ++end) {
+      auto& job = jobs[end];
+      if (0 == (job.section->flags & SECTION_FLAG_COMPRESSED))
+        continue;
+      if (parse_chunks(job.section->data, job.section->size, job.buffer, &chunks)) {
+        ++failures;
+        break;
+      }
+      batch_size += job.buffer.size();
+    }
+    if (failures)
+      break;
+
+    pool.run(chunks.size(), [&](size_t i) {
+      if (decode_chunk(chunks[i])) {
+        ++failures;
+      }
+    });
+    if (failures)
+      break;
+
+    pool.run(end - begin, [&](size_t i) {
+      auto& job = jobs[begin + i];
+      auto& section = *job.section;
+      bool compressed = (section.flags & SECTION_FLAG_COMPRESSED);
+      ByteReader r(compressed ? job.buffer.data() : section.data,
+                   compressed ? job.buffer.size() : section.size);
+      if (job.texture) {
+        texture_header_t header;
+        if (read_texture_header(r, &header)) {
+          ++failures;
+        } else {
+          auto pixels = r.bytes(header.size);
+          job.texture->format = header.format;
+          job.texture->width  = header.width;
+          job.texture->height = header.height;
+          job.texture->pixels.assign(pixels, pixels + header.size);
+        }
+      } else {
+        uint32_t state_id;
+        if (read_drawcall(r, states_, *job.drawcall, &state_id)) {
+          ++failures;
+        }
+      }
+      std::vector<uint8_t>().swap(job.buffer);
+    });
+    begin = end;
+  }
+
+  // aliases are resolved by id instead of copying the pixels
+  for (auto& drawcall : trace->drawcalls) {
+    if (failures)
+      break;
+    auto alias = aliases_.find(drawcall.texture_id);
+    if (alias == aliases_.end())
+      continue;
+    if (!textures_.count(alias->second)) {
+      ++failures;
+      break;
+    }
+    drawcall.texture_id = alias->second;
+  }
+
+  if (failures) {
+    trace->drawcalls.clear();
+    trace->textures.clear();
+    return -1;
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CGLTraceWriter::CGLTraceWriter()
+  : codec_(0)
+  , compress_level_(0)
+  , index_count_(0)
+  , offset_(0)
+  , drawcall_count_(0)
+  , alias_count_(0)
+  , written_states_(0)
+  , failed_(false)
+{}
+
+CGLTraceWriter::~CGLTraceWriter() {
+  if (ofs_.is_open()) {
+    this->finish();
+  }
+}
+
+int CGLTraceWriter::beginTrace(const char* filename,
+                               CGLTrace::eCompression compression) {
+  if (ofs_.is_open()) {
+    this->finish();
+  }
+
+  ofs_.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!ofs_.is_open()) {
+    std::cerr << "couldn't create file: " << filename << "!" << std::endl;
+    return -1;
+  }
+
+  filename_ = filename;
+  compress_level_ = 0;
+  switch (compression) {
+  case CGLTrace::COMPRESSION_FAST:
+    codec_ = CODEC_LZ4;
+    break;
+  case CGLTrace::COMPRESSION_HIGH:
+    codec_ = CODEC_DEFLATE;
+    compress_level_ = 6;
+    break;
+  default:
+    codec_ = 0;
+    break;
+  }
+  buffer_.clear();
+  index_.clear();
+  index_count_ = 0;
+  offset_ = 0;
+  drawcall_count_ = 0;
+  alias_count_ = 0;
+  texture_hashes_.clear();
+  states_.clear();
+  written_states_ = 0;
+  failed_ = false;
+
+  ByteWriter w(buffer_);
+  w.u32(MAGIC);
+  w.u32(VERSION);
+  w.u32(0);
+  w.u32(0);
+  return 0;
+}
+
+size_t CGLTraceWriter::beginSection(uint32_t tag, uint32_t id) {
+  size_t start = buffer_.size();
+
+  ByteWriter iw(index_);
+  iw.u32(tag);
+  iw.u32(id);
+  iw.u64(offset_ + start);
+  ++index_count_;
+
+  // the size is patched by endSection()
+  ByteWriter w(buffer_);
+  w.u32(tag);
+  w.u32(0);
+  w.u64(0);
+  return start;
+}
+
+int CGLTraceWriter::endSection(size_t start) {
+  uint64_t size = buffer_.size() - start - SECTION_HEADER_SIZE;
+  if (codec_ && size >= COMPRESS_MIN_SIZE) {
+    std::vector<uint8_t> compressed;
+    compress_payload(buffer_.data() + start + SECTION_HEADER_SIZE, size,
+                     codec_, compress_level_, compressed);
+    if (compressed.size() < size) {
+      buffer_.resize(start + SECTION_HEADER_SIZE);
+      buffer_.insert(buffer_.end(), compressed.begin(), compressed.end());
+      buffer_[start + 4] |= SECTION_FLAG_COMPRESSED;
+      size = compressed.size();
+    }
+  }
+  for (int i = 0; i < 8; ++i) {
+    buffer_[start + 8 + i] = uint8_t(size >> (i * 8));
+  }
+  if (buffer_.size() < WRITER_FLUSH_SIZE)
+    return 0;
+  return this->flush();
+}
+
+int CGLTraceWriter::flush() {
+  ofs_.write(reinterpret_cast<const char*>(buffer_.data()), buffer_.size());
+  offset_ += buffer_.size();
+  buffer_.clear();
+  if (!ofs_) {
+    std::cerr << "couldn't write file: " << filename_ << "!" << std::endl;
+    failed_ = true;
+    return -1;
+  }
+  return 0;
+}
+
+bool CGLTraceWriter::matchTexture(uint64_t offset, const CGLTrace::texture_t& texture) {
+  std::vector<uint8_t> section;
+  if (offset >= offset_) {
+    auto p = buffer_.data() + (offset - offset_);
+    ByteReader r(p, SECTION_HEADER_SIZE);
+    r.u64();
+    section.assign(p, p + SECTION_HEADER_SIZE + r.u64());
+  } else {
+    // already flushed, read it back
+    ofs_.flush();
+    std::ifstream ifs(filename_, std::ios::in | std::ios::binary);
+    ifs.seekg(offset);
+    section.resize(SECTION_HEADER_SIZE);
+    if (!ifs.read(reinterpret_cast<char*>(section.data()), SECTION_HEADER_SIZE))
+      return false;
+    ByteReader r(section.data(), SECTION_HEADER_SIZE);
+    r.u64();
+    section.resize(SECTION_HEADER_SIZE + r.u64());
+    if (!ifs.read(reinterpret_cast<char*>(section.data() + SECTION_HEADER_SIZE),
+                  section.size() - SECTION_HEADER_SIZE))
+      return false;
+  }
+
+  ByteReader hr(section.data(), SECTION_HEADER_SIZE);
+  hr.u32();
+  uint32_t flags = hr.u32();
+  std::vector<uint8_t> buffer;
+  const uint8_t* payload;
+  size_t payload_size;
+  if (decode_payload(section.data() + SECTION_HEADER_SIZE,
+                     section.size() - SECTION_HEADER_SIZE,
+                     flags, buffer, &payload, &payload_size))
+    return false;
+
+  ByteReader r(payload, payload_size);
+  texture_header_t header;
+  if (read_texture_header(r, &header))
+    return false;
+  return header.format == texture.format
+      && header.width  == texture.width
+      && header.height == texture.height
+      && header.size   == texture.pixels.size()
+      && 0 == memcmp(r.bytes(header.size), texture.pixels.data(), header.size);
+}
+
+int CGLTraceWriter::addTexture(uint32_t id, const CGLTrace::texture_t& texture) {
+  if (!ofs_.is_open() || failed_)
+    return -1;
+
+  uint64_t hash = texture.computeHash();
+  auto range = texture_hashes_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (!this->matchTexture(it->second.offset, texture))
+      continue;
+    auto start = this->beginSection(SECTION_ALIAS, id);
+    ByteWriter w(buffer_);
+    w.u32(id);
+    w.u32(it->second.id);
+    ++alias_count_;
+    return this->endSection(start);
+  }
+
+  texture_entry_t entry;
+  entry.id = id;
+  // flush first so large textures do not double the buffer
+  if (!buffer_.empty()
+   && buffer_.size() + texture.pixels.size() > WRITER_FLUSH_SIZE) {
+    if (this->flush())
+      return -1;
+  }
+  entry.offset = offset_ + buffer_.size();
+  texture_hashes_.emplace(hash, entry);
+
+  auto start = this->beginSection(SECTION_TEXTURE, id);
+  ByteWriter w(buffer_);
+  w.u32(id);
+  w.u32(texture.format);
+  w.u32(texture.width);
+  w.u32(texture.height);
+  w.u64(texture.pixels.size());
+  w.bytes(texture.pixels.data(), texture.pixels.size());
+  return this->endSection(start);
+}
+
+int CGLTraceWriter::addDrawcall(const CGLTrace::drawcall_t& drawcall) {
+  if (!ofs_.is_open() || failed_)
+    return -1;
+  uint32_t state_id = states_.intern(drawcall.states);
+  auto start = this->beginSection(SECTION_DRAWCALL, drawcall_count_++);
+  ByteWriter w(buffer_);
+  write_drawcall(w, drawcall, state_id);
+  if (this->endSection(start))
+    return -1;
+  if (states_.size() - written_states_ >= WRITER_STATE_BATCH)
+    return this->writeStates();
+  return 0;
+}
+
+int CGLTraceWriter::writeStates() {
+  if (written_states_ == states_.size())
+    return 0;
+  auto start = this->beginSection(SECTION_STATES, written_states_);
+  ByteWriter w(buffer_);
+  w.u32(written_states_);
+  w.u32(states_.size() - written_states_);
+  CGLTrace::states_t base;
+  if (written_states_) {
+    base = states_[written_states_ - 1];
+  } else {
+    memset(&base, 0, sizeof(base));
+  }
+  for (uint32_t id = written_states_; id < states_.size(); ++id) {
+    write_state_delta(w, base, states_[id]);
+    base = states_[id];
+  }
+  written_states_ = states_.size();
+  return this->endSection(start);
+}
+
+int CGLTraceWriter::finish() {
+  if (!ofs_.is_open())
+    return -1;
+
+  // a trace with failed writes is closed without its index so readers
+  // reject it instead of loading missing sections
+  if (failed_ || this->writeStates()) {
+    ofs_.close();
+    std::vector<uint8_t>().swap(buffer_);
+    std::vector<uint8_t>().swap(index_);
+    return -1;
+  }
+
+  uint64_t index_offset = offset_ + buffer_.size();
+  ByteWriter w(buffer_);
+  w.u32(SECTION_INDEX);
+  w.u32(0);
+  w.u64(4 + index_.size());
+  w.u32(index_count_);
+  w.bytes(index_.data(), index_.size());
+
+  w.u32(SECTION_END);
+  w.u32(0);
+  w.u64(8);
+  w.u64(index_offset);
+
+  int ret = this->flush();
+  ofs_.close();
+  if (0 == ret && !ofs_) {
+    std::cerr << "couldn't write file: " << filename_ << "!" << std::endl;
+    ret = -1;
+  }
+  std::vector<uint8_t>().swap(buffer_);
+  std::vector<uint8_t>().swap(index_);
+  return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int CGLTrace::saveBinary(const char* filename, eCompression compression) {
+  CGLTraceWriter writer;
+  if (writer.beginTrace(filename, compression))
+    return -1;
+
+  // in id order so aliases point at the lowest id, as in dedupTextures()
+  std::vector<uint32_t> ids;
+  ids.reserve(textures.size());
+  for (auto& texture : textures) {
+    ids.push_back(texture.first);
+  }
+  std::sort(ids.begin(), ids.end());
+  for (auto id : ids) {
+    if (writer.addTexture(id, textures.at(id)))
+      return -1;
+  }
+
+  for (auto& drawcall : drawcalls) {
+    if (writer.addDrawcall(drawcall))
+      return -1;
+  }
+
+  return writer.finish();
+}
+
+int CGLTrace::loadBinary(const char* filename, uint64_t* file_size) {
+  CGLTraceReader reader;
+  if (reader.open(filename))
+    return -1;
+  *file_size = reader.fileSize();
+
+  if (reader.readTrace(this)) {
+    std::cerr << "invalid trace sections: " << filename << "!" << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
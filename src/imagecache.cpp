@@ -0,0 +1,157 @@
+#include "imagecache.hpp"
+#include "imageutil.hpp"
+#include <sys/stat.h>
+#include <iostream>
+
+using namespace cocogfx;
+
+// path, modification time, file size and format
+static int make_key(const char *filename, ePixelFormat format, std::string* key) {
+  struct stat st;
+  if (stat(filename, &st)) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  *key = filename;
+  key->push_back('\0');
+  // nanoseconds so a rewrite within the same second is seen
+#if defined(__APPLE__)
+  auto mtime = uint64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  auto mtime = uint64_t(st.st_mtime) * 1000000000;
+#else
+  auto mtime = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  *key += std::to_string(mtime);
+  key->push_back(':');
+  *key += std::to_string(uint64_t(st.st_size));
+  key->push_back(':');
+  *key += std::to_string(int(format));
+  return 0;
+}
+
+ImageCache::ImageCache(size_t max_bytes)
+  : max_bytes_(max_bytes)
+  , bytes_(0)
+  , hits_(0)
+  , misses_(0)
+{}
+
+int ImageCache::load(const char *filename,
+                     ePixelFormat format,
+                     SharedImage *image) {
+  std::string key;
+  if (make_key(filename, format, &key))
+    return -1;
+
+  std::promise<SharedImage> promise;
+  std::shared_future<SharedImage> future;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      future = it->second.image;
+    } else {
+      ++misses_;
+      lru_.push_front(key);
+      entry_t entry;
+      entry.image = promise.get_future().share();
+      entry.lru   = lru_.begin();
+      entry.bytes = 0;
+      entry.ready = false;
+      entries_.emplace(key, entry);
+    }
+  }
+
+  // another thread owns the decode, wait for it
+  if (future.valid()) {
+    *image = future.get();
+    return image->pixels ? 0 : -1;
+  }
+
+  auto discard = [&]() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.erase(it->second.lru);
+      entries_.erase(it);
+    }
+  };
+
+  SharedImage decoded;
+  int ret;
+  try {
+    ret = LoadSharedImage(filename, format, &decoded);
+  } catch (...) {
+    // waiters rethrow it, the next load decodes again
+    promise.set_exception(std::current_exception());
+    discard();
+    throw;
+  }
+  promise.set_value(decoded);
+
+  if (ret) {
+    // do not cache failures
+    discard();
+    return ret;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      it->second.bytes = decoded.pixels->size();
+      it->second.ready = true;
+      bytes_ += it->second.bytes;
+      this->evict();
+    }
+  }
+
+  *image = decoded;
+  return 0;
+}
+
+void ImageCache::evict() {
+  // oldest first, entries still decoding are skipped
+  auto it = lru_.end();
+  while (bytes_ > max_bytes_ && it != lru_.begin()) {
+    --it;
+    auto entry = entries_.find(*it);
+    if (!entry->second.ready)
+      continue;
+    bytes_ -= entry->second.bytes;
+    entries_.erase(entry);
+    it = lru_.erase(it);
+  }
+}
+
+void ImageCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = lru_.begin(); it != lru_.end();) {
+    auto entry = entries_.find(*it);
+    if (entry->second.ready) {
+      bytes_ -= entry->second.bytes;
+      entries_.erase(entry);
+      it = lru_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+size_t ImageCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+uint64_t ImageCache::hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+uint64_t ImageCache::misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
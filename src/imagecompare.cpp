@@ -0,0 +1,755 @@
+#include "imageutil.hpp"
+#include "workerpool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+using namespace cocogfx;
+
+namespace {
+
+// partial statistics of a stripe of rows
+struct stats_t {
+  uint32_t mismatches;
+  uint8_t  max_error[4];
+  uint64_t sum[4];
+  uint64_t sum_sq[4];
+  TRect<uint32_t> bounds;
+  std::vector<CompareMismatch> errors;
+  double delta_e_sum;
+  float max_delta_e;
+
+  stats_t() : mismatches(0), delta_e_sum(0), max_delta_e(0) {
+    for (int i = 0; i < 4; ++i) {
+      max_error[i] = 0;
+      sum[i] = 0;
+      sum_sq[i] = 0;
+    }
+    bounds.left   = std::numeric_limits<uint32_t>::max();
+    bounds.top    = std::numeric_limits<uint32_t>::max();
+    bounds.right  = 0;
+    bounds.bottom = 0;
+  }
+
+  void merge(const stats_t& other, uint32_t max_errors) {
+    mismatches += other.mismatches;
+    for (int i = 0; i < 4; ++i) {
+      max_error[i] = std::max(max_error[i], other.max_error[i]);
+      sum[i] += other.sum[i];
+      sum_sq[i] += other.sum_sq[i];
+    }
+    bounds.left   = std::min(bounds.left, other.bounds.left);
+    bounds.top    = std::min(bounds.top, other.bounds.top);
+    bounds.right  = std::max(bounds.right, other.bounds.right);
+    bounds.bottom = std::max(bounds.bottom, other.bounds.bottom);
+    delta_e_sum += other.delta_e_sum;
+    max_delta_e = std::max(max_delta_e, other.max_delta_e);
+    for (auto& error : other.errors) {
+      if (errors.size() >= max_errors)
+        break;
+      errors.push_back(error);
+    }
+  }
+};
+
+// Compares two images row by row on 8-bit ARGB values.
+// Rows already in A8R8G8B8 are compared in place, identical rows of
+// images sharing a format are skipped with a memcmp and the remaining
+// ones go through branch-free byte loops the compiler vectorizes.
+class ImageComparator {
+public:
+  ImageComparator(const uint8_t* pixels1,
+                  ePixelFormat format1,
+                  int32_t pitch1,
+                  const uint8_t* pixels2,
+                  ePixelFormat format2,
+                  int32_t pitch2,
+                  uint32_t width,
+                  const CompareOptions& options)
+    : width_(width)
+    , options_(options) {
+    images_[0].init(pixels1, format1, pitch1);
+    images_[1].init(pixels2, format2, pitch2);
+    same_format_ = (format1 == format2);
+  }
+
+  // diff_pixels receives R8G8B8 diff rows if a diff mode is selected,
+  // rows without differences are left untouched
+  void compare(stats_t* stats,
+               uint32_t y_begin,
+               uint32_t y_end,
+               uint8_t* diff_pixels) const {
+    uint32_t row_size = width_ * 4;
+    std::vector<uint8_t> scratch(2 * row_size);
+    std::vector<uint8_t> diff(row_size);
+
+    for (uint32_t y = y_begin; y < y_end; ++y) {
+      auto row1 = images_[0].row(y);
+      auto row2 = images_[1].row(y);
+      if (same_format_
+       && 0 == memcmp(row1, row2, width_ * images_[0].bpp))
+        continue;
+
+      row1 = images_[0].expand(scratch.data(), row1, width_);
+      row2 = images_[1].expand(scratch.data() + row_size, row2, width_);
+
+      auto d = diff.data();
+      for (uint32_t i = 0; i < row_size; ++i) {
+        int delta = int(row1[i]) - int(row2[i]);
+        d[i] = static_cast<uint8_t>(delta < 0 ? -delta : delta);
+      }
+
+      uint32_t sum[4] = {0, 0, 0, 0};
+      uint64_t sum_sq[4] = {0, 0, 0, 0};
+      uint8_t max_error[4] = {0, 0, 0, 0};
+      for (uint32_t x = 0; x < width_; ++x, d += 4) {
+        uint8_t max_delta = 0;
+        for (int c = 0; c < 4; ++c) {
+          sum[c] += d[c];
+          sum_sq[c] += d[c] * d[c];
+          max_error[c] = std::max(max_error[c], d[c]);
+          max_delta = std::max(max_delta, d[c]);
+        }
+        if (max_delta > options_.tolerance) {
+          this->addMismatch(stats, x, y, row1 + x * 4, row2 + x * 4);
+        }
+      }
+
+      for (int c = 0; c < 4; ++c) {
+        stats->sum[c] += sum[c];
+        stats->sum_sq[c] += sum_sq[c];
+        stats->max_error[c] = std::max(stats->max_error[c], max_error[c]);
+      }
+
+      if (diff_pixels) {
+        this->writeDiff(diff_pixels + size_t(y) * width_ * 3, diff.data());
+      }
+    }
+  }
+
+  // convert rows to luma planes for SSIM and accumulate the delta E
+  void extract(stats_t* stats,
+               uint32_t y_begin,
+               uint32_t y_end,
+               float* luma1,
+               float* luma2,
+               bool delta_e) const {
+    uint32_t row_size = width_ * 4;
+    std::vector<uint8_t> scratch(2 * row_size);
+
+    for (uint32_t y = y_begin; y < y_end; ++y) {
+      auto row1 = images_[0].expand(scratch.data(), images_[0].row(y), width_);
+      auto row2 = images_[1].expand(scratch.data() + row_size, images_[1].row(y), width_);
+      if (luma1) {
+        auto dst1 = luma1 + size_t(y) * width_;
+        auto dst2 = luma2 + size_t(y) * width_;
+        for (uint32_t x = 0; x < width_; ++x) {
+          dst1[x] = GetLuma(row1 + x * 4);
+          dst2[x] = GetLuma(row2 + x * 4);
+        }
+      }
+      if (delta_e) {
+        double sum = 0;
+        float max_delta_e = 0;
+        for (uint32_t x = 0; x < width_; ++x) {
+          auto pixel1 = row1 + x * 4;
+          auto pixel2 = row2 + x * 4;
+          if (0 == memcmp(pixel1, pixel2, 3))
+            continue;
+          float lab1[3], lab2[3];
+          GetLab(lab1, pixel1);
+          GetLab(lab2, pixel2);
+          float dl = lab1[0] - lab2[0];
+          float da = lab1[1] - lab2[1];
+          float db = lab1[2] - lab2[2];
+          float de = sqrtf(dl * dl + da * da + db * db);
+          sum += de;
+          max_delta_e = std::max(max_delta_e, de);
+        }
+        stats->delta_e_sum += sum;
+        stats->max_delta_e = std::max(stats->max_delta_e, max_delta_e);
+      }
+    }
+  }
+
+private:
+
+  void writeDiff(uint8_t* dst, const uint8_t* d) const {
+    switch (options_.diff_mode) {
+    case CompareOptions::DIFF_ABSOLUTE:
+      for (uint32_t x = 0; x < width_; ++x, d += 4, dst += 3) {
+        dst[0] = d[0];
+        dst[1] = d[1];
+        dst[2] = d[2];
+      }
+      break;
+    case CompareOptions::DIFF_MASK:
+      for (uint32_t x = 0; x < width_; ++x, d += 4, dst += 3) {
+        uint8_t max_delta = std::max(std::max(d[0], d[1]), std::max(d[2], d[3]));
+        uint8_t value = (max_delta > options_.tolerance) ? 0xff : 0;
+        dst[0] = value;
+        dst[1] = value;
+        dst[2] = value;
+      }
+      break;
+    case CompareOptions::DIFF_HEATMAP: {
+      auto& heatmap = GetHeatmap();
+      for (uint32_t x = 0; x < width_; ++x, d += 4, dst += 3) {
+        uint8_t max_delta = std::max(std::max(d[0], d[1]), std::max(d[2], d[3]));
+        memcpy(dst, &heatmap[max_delta], 3);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  // black, blue, cyan, green, yellow, red over the square root of the
+  // difference so small errors stay visible
+  static const std::vector<ColorARGB>& GetHeatmap() {
+    static const std::vector<ColorARGB> table = []() {
+      static const int stops[6][3] = {
+        {0, 0, 0}, {0, 0, 255}, {0, 255, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}
+      };
+      std::vector<ColorARGB> colors(256);
+      for (int i = 0; i < 256; ++i) {
+        float t = sqrtf(i / 255.0f) * 5;
+        int s = std::min(int(t), 4);
+        float f = t - s;
+        int rgb[3];
+        for (int c = 0; c < 3; ++c) {
+          rgb[c] = int(stops[s][c] + f * (stops[s + 1][c] - stops[s][c]) + 0.5f);
+        }
+        colors[i] = ColorARGB(rgb[0], rgb[1], rgb[2]);
+      }
+      return colors;
+    }();
+    return table;
+  }
+
+  static float GetLuma(const uint8_t* bgra) {
+    return 0.114f * bgra[0] + 0.587f * bgra[1] + 0.299f * bgra[2];
+  }
+
+  // sRGB to CIE L*a*b* with a D65 white point
+  static void GetLab(float* lab, const uint8_t* bgra) {
+    static const std::vector<float> linear = []() {
+      std::vector<float> table(256);
+      for (int i = 0; i < 256; ++i) {
+        float c = i / 255.0f;
+        table[i] = (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+      }
+      return table;
+    }();
+    float r = linear[bgra[2]];
+    float g = linear[bgra[1]];
+    float b = linear[bgra[0]];
+    float xyz[3] = {
+      (0.4124f * r + 0.3576f * g + 0.1805f * b) / 0.95047f,
+      (0.2126f * r + 0.7152f * g + 0.0722f * b),
+      (0.0193f * r + 0.1192f * g + 0.9505f * b) / 1.08883f,
+    };
+    for (int i = 0; i < 3; ++i) {
+      xyz[i] = (xyz[i] > 0.008856f) ? cbrtf(xyz[i]) : (7.787f * xyz[i] + 16.0f / 116.0f);
+    }
+    lab[0] = 116.0f * xyz[1] - 16.0f;
+    lab[1] = 500.0f * (xyz[0] - xyz[1]);
+    lab[2] = 200.0f * (xyz[1] - xyz[2]);
+  }
+
+  struct image_t {
+    const uint8_t* pixels;
+    ePixelFormat format;
+    int32_t pitch;
+    uint32_t bpp;
+    Format::pfn_convert_from convert_from;
+
+    void init(const uint8_t* pixels, ePixelFormat format, int32_t pitch) {
+      this->pixels = pixels;
+      this->format = format;
+      this->pitch = pitch;
+      this->bpp = Format::GetInfo(format).BytePerPixel;
+      this->convert_from = Format::GetConvertFrom(format, true);
+    }
+
+    const uint8_t* row(uint32_t y) const {
+      return pixels + int64_t(y) * pitch;
+    }
+
+    // returns src as is when it is already A8R8G8B8
+    const uint8_t* expand(uint8_t* dst, const uint8_t* src, uint32_t width) const {
+      if (format == FORMAT_A8R8G8B8)
+        return src;
+      auto out = reinterpret_cast<uint32_t*>(dst);
+      for (uint32_t x = 0; x < width; ++x) {
+        out[x] = convert_from(src).value;
+        src += bpp;
+      }
+      return dst;
+    }
+  };
+
+  void addMismatch(stats_t* stats,
+                   uint32_t x,
+                   uint32_t y,
+                   const uint8_t* pixel1,
+                   const uint8_t* pixel2) const {
+    ++stats->mismatches;
+    stats->bounds.left   = std::min(stats->bounds.left, x);
+    stats->bounds.top    = std::min(stats->bounds.top, y);
+    stats->bounds.right  = std::max(stats->bounds.right, x + 1);
+    stats->bounds.bottom = std::max(stats->bounds.bottom, y + 1);
+    if (stats->errors.size() < options_.max_errors) {
+      CompareMismatch error;
+      error.x = x;
+      error.y = y;
+      memcpy(&error.first.value, pixel1, 4);
+      memcpy(&error.second.value, pixel2, 4);
+      stats->errors.push_back(error);
+    }
+  }
+
+  image_t images_[2];
+  bool same_format_;
+  uint32_t width_;
+  const CompareOptions& options_;
+};
+
+// number of channels contributing to the mean error and PSNR
+uint32_t GetChannelMask(ePixelFormat format) {
+  auto& info = Format::GetInfo(format);
+  uint32_t mask = 0;
+  if (info.Red || info.Green || info.Blue || info.Luminance)
+    mask |= 0x7;
+  if (info.Alpha)
+    mask |= 0x8;
+  return mask ? mask : 0xf;
+}
+
+// SSIM over a luma plane pair using a separable 11-tap gaussian window
+// (sigma 1.5), edges are clamped. The plane is processed in stripes of
+// rows scheduled on the worker pool, each stripe blurs the five moment
+// planes horizontally over its rows plus the window apron, then
+// vertically. Returns the mean SSIM and the mean contrast-structure term.
+class SSIMKernel {
+public:
+  enum { RADIUS = 5, TAPS = 2 * RADIUS + 1, STRIPE_ROWS = 32 };
+
+  SSIMKernel() {
+    float sum = 0;
+    for (int i = 0; i < TAPS; ++i) {
+      float d = float(i - RADIUS);
+      weights_[i] = expf(-(d * d) / (2 * 1.5f * 1.5f));
+      sum += weights_[i];
+    }
+    for (int i = 0; i < TAPS; ++i) {
+      weights_[i] /= sum;
+    }
+  }
+
+  void compute(const float* plane1,
+               const float* plane2,
+               uint32_t width,
+               uint32_t height,
+               WorkerPool& pool,
+               double* ssim,
+               double* cs) const {
+    uint32_t num_stripes = (height + STRIPE_ROWS - 1) / STRIPE_ROWS;
+    std::vector<double> ssim_sums(num_stripes);
+    std::vector<double> cs_sums(num_stripes);
+    pool.run(num_stripes, [&](size_t i) {
+      uint32_t y_begin = i * STRIPE_ROWS;
+      uint32_t y_end = std::min<uint32_t>(y_begin + STRIPE_ROWS, height);
+      this->computeStripe(plane1, plane2, width, height, y_begin, y_end,
+                          &ssim_sums[i], &cs_sums[i]);
+    });
+
+    double ssim_sum = 0;
+    double cs_sum = 0;
+    for (uint32_t i = 0; i < num_stripes; ++i) {
+      ssim_sum += ssim_sums[i];
+      cs_sum += cs_sums[i];
+    }
+    double count = double(width) * height;
+    *ssim = ssim_sum / count;
+    *cs = cs_sum / count;
+  }
+
+private:
+
+  void computeStripe(const float* plane1,
+                     const float* plane2,
+                     uint32_t width,
+                     uint32_t height,
+                     uint32_t y_begin,
+                     uint32_t y_end,
+                     double* ssim_sum,
+                     double* cs_sum) const {
+    static const float C1 = (0.01f * 255) * (0.01f * 255);
+    static const float C2 = (0.03f * 255) * (0.03f * 255);
+
+    // horizontally blurred moments: x, y, x*x, y*y, x*y
+    uint32_t rows = (y_end - y_begin) + 2 * RADIUS;
+    std::vector<float> moments(5 * size_t(rows) * width);
+    std::vector<float> padded(5 * size_t(width + 2 * RADIUS));
+    auto pad = [&](int m) { return padded.data() + m * (width + 2 * RADIUS); };
+    auto moment = [&](int m, uint32_t r) {
+      return moments.data() + (size_t(m) * rows + r) * width;
+    };
+
+    for (uint32_t r = 0; r < rows; ++r) {
+      int y = int(y_begin + r) - RADIUS;
+      y = std::min(std::max(y, 0), int(height) - 1);
+      auto src1 = plane1 + size_t(y) * width;
+      auto src2 = plane2 + size_t(y) * width;
+      for (int x = -RADIUS; x < int(width) + RADIUS; ++x) {
+        int sx = std::min(std::max(x, 0), int(width) - 1);
+        float a = src1[sx];
+        float b = src2[sx];
+        pad(0)[x + RADIUS] = a;
+        pad(1)[x + RADIUS] = b;
+        pad(2)[x + RADIUS] = a * a;
+        pad(3)[x + RADIUS] = b * b;
+        pad(4)[x + RADIUS] = a * b;
+      }
+      for (int m = 0; m < 5; ++m) {
+        auto src = pad(m);
+        auto dst = moment(m, r);
+        for (uint32_t x = 0; x < width; ++x) {
+          dst[x] = 0;
+        }
+        for (int k = 0; k < TAPS; ++k) {
+          float w = weights_[k];
+          for (uint32_t x = 0; x < width; ++x) {
+            dst[x] += w * src[x + k];
+          }
+        }
+      }
+    }
+
+    std::vector<float> blurred(5 * size_t(width));
+    double ssim_total = 0;
+    double cs_total = 0;
+    for (uint32_t y = y_begin; y < y_end; ++y) {
+      uint32_t r = y - y_begin;
+      for (int m = 0; m < 5; ++m) {
+        auto dst = blurred.data() + m * width;
+        for (uint32_t x = 0; x < width; ++x) {
+          dst[x] = 0;
+        }
+        for (int k = 0; k < TAPS; ++k) {
+          float w = weights_[k];
+          auto src = moment(m, r + k);
+          for (uint32_t x = 0; x < width; ++x) {
+            dst[x] += w * src[x];
+          }
+        }
+      }
+      auto mu1 = blurred.data();
+      auto mu2 = mu1 + width;
+      auto e11 = mu2 + width;
+      auto e22 = e11 + width;
+      auto e12 = e22 + width;
+      float ssim_row = 0;
+      float cs_row = 0;
+      for (uint32_t x = 0; x < width; ++x) {
+        float mu11 = mu1[x] * mu1[x];
+        float mu22 = mu2[x] * mu2[x];
+        float mu12 = mu1[x] * mu2[x];
+        float l = (2 * mu12 + C1) / (mu11 + mu22 + C1);
+        float c = (2 * (e12[x] - mu12) + C2) / ((e11[x] - mu11) + (e22[x] - mu22) + C2);
+        ssim_row += l * c;
+        cs_row += c;
+      }
+      ssim_total += ssim_row;
+      cs_total += cs_row;
+    }
+    *ssim_sum = ssim_total;
+    *cs_sum = cs_total;
+  }
+
+  float weights_[TAPS];
+};
+
+// 2x2 box downsampling for the MS-SSIM pyramid
+void Downsample(std::vector<float>& dst,
+                const std::vector<float>& src,
+                uint32_t width,
+                uint32_t height) {
+  uint32_t dst_width = width / 2;
+  uint32_t dst_height = height / 2;
+  dst.resize(size_t(dst_width) * dst_height);
+  for (uint32_t y = 0; y < dst_height; ++y) {
+    auto src0 = src.data() + size_t(2 * y) * width;
+    auto src1 = src0 + width;
+    auto out = dst.data() + size_t(y) * dst_width;
+    for (uint32_t x = 0; x < dst_width; ++x) {
+      out[x] = 0.25f * (src0[2 * x] + src0[2 * x + 1] + src1[2 * x] + src1[2 * x + 1]);
+    }
+  }
+}
+
+}
+
+static void ComputeSSIM(std::vector<float>& luma1,
+                        std::vector<float>& luma2,
+                        uint32_t width,
+                        uint32_t height,
+                        const CompareOptions& options,
+                        WorkerPool& pool,
+                        CompareResult &result) {
+  // standard MS-SSIM scale weights
+  static const double scale_weights[5] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+
+  SSIMKernel kernel;
+  double ssim, cs;
+  kernel.compute(luma1.data(), luma2.data(), width, height, pool, &ssim, &cs);
+  result.ssim = ssim;
+  if (0 == (options.metrics & CompareOptions::METRIC_MS_SSIM))
+    return;
+
+  // use the scales whose smaller side still covers the window
+  uint32_t num_scales = 1;
+  while (num_scales < 5
+      && std::min(width >> num_scales, height >> num_scales) >= SSIMKernel::TAPS) {
+    ++num_scales;
+  }
+  double weight_sum = 0;
+  for (uint32_t i = 0; i < num_scales; ++i) {
+    weight_sum += scale_weights[i];
+  }
+
+  double ms_ssim = 1.0;
+  std::vector<float> next1, next2;
+  for (uint32_t i = 0;; ++i) {
+    double weight = scale_weights[i] / weight_sum;
+    if (i + 1 == num_scales) {
+      ms_ssim *= pow(std::max(ssim, 0.0), weight);
+      break;
+    }
+    ms_ssim *= pow(std::max(cs, 0.0), weight);
+    Downsample(next1, luma1, width, height);
+    Downsample(next2, luma2, width, height);
+    luma1.swap(next1);
+    luma2.swap(next2);
+    width /= 2;
+    height /= 2;
+    kernel.compute(luma1.data(), luma2.data(), width, height, pool, &ssim, &cs);
+  }
+  result.ms_ssim = ms_ssim;
+}
+
+int cocogfx::CompareImages(const uint8_t* pixels1,
+                           cocogfx::ePixelFormat format1,
+                           uint32_t width1,
+                           uint32_t height1,
+                           int32_t pitch1,
+                           const uint8_t* pixels2,
+                           cocogfx::ePixelFormat format2,
+                           uint32_t width2,
+                           uint32_t height2,
+                           int32_t pitch2,
+                           CompareResult &result,
+                           const CompareOptions& options) {
+  for (auto format : {format1, format2}) {
+    if (0 == Format::GetInfo(format).BytePerPixel) {
+      std::cerr << "unsupported pixel format: " << format << "!" << std::endl;
+      return -1;
+    }
+  }
+
+  if (width1 != width2
+   || height1 != height2) {
+    std::cerr << "image size mismatch: " << width1 << "x" << height1
+              << " vs " << width2 << "x" << height2 << "!" << std::endl;
+    return -1;
+  }
+
+  uint32_t width = width1;
+  uint32_t height = height1;
+
+  // stripes of about 256KB of ARGB pixels
+  uint32_t stripe_rows = std::max(1u, (256 * 1024) / std::max(1u, width * 4));
+  uint32_t num_stripes = (height + stripe_rows - 1) / stripe_rows;
+  std::vector<stats_t> stripes(num_stripes);
+
+  // zero-filled, which is black in every diff mode
+  std::vector<uint8_t> diff_pixels;
+  if (options.diff_filename && options.diff_mode != CompareOptions::DIFF_NONE) {
+    diff_pixels.resize(size_t(width) * height * 3);
+  }
+
+  // one pool for the whole comparison
+  std::unique_ptr<WorkerPool> local_pool;
+  if (options.num_threads) {
+    local_pool.reset(new WorkerPool(options.num_threads));
+  }
+  auto& pool = local_pool ? *local_pool : WorkerPool::Shared();
+
+  ImageComparator comparator(pixels1, format1, pitch1,
+                             pixels2, format2, pitch2,
+                             width, options);
+  pool.run(num_stripes, [&](size_t i) {
+    uint32_t y_begin = i * stripe_rows;
+    uint32_t y_end = std::min(y_begin + stripe_rows, height);
+    comparator.compare(&stripes[i], y_begin, y_end,
+                       diff_pixels.empty() ? nullptr : diff_pixels.data());
+  });
+
+  // merge in row order so the recorded mismatches come first to last
+  stats_t stats;
+  for (auto& stripe : stripes) {
+    stats.merge(stripe, options.max_errors);
+  }
+
+  uint32_t mask = GetChannelMask(format1) | GetChannelMask(format2);
+  uint32_t channels = 0;
+  uint64_t sum = 0;
+  uint64_t sum_sq = 0;
+  for (int c = 0; c < 4; ++c) {
+    result.max_error.m[c] = stats.max_error[c];
+    if (mask & (1 << c)) {
+      sum += stats.sum[c];
+      sum_sq += stats.sum_sq[c];
+      ++channels;
+    }
+  }
+
+  double samples = double(width) * height * channels;
+  result.mismatches = stats.mismatches;
+  result.mean_error = samples ? (sum / samples) : 0.0;
+  double mse = samples ? (sum_sq / samples) : 0.0;
+  result.psnr = (mse > 0) ? 10.0 * log10((255.0 * 255.0) / mse)
+                          : std::numeric_limits<double>::infinity();
+  if (stats.mismatches) {
+    result.bounds = stats.bounds;
+  } else {
+    result.bounds.left   = 0;
+    result.bounds.top    = 0;
+    result.bounds.right  = 0;
+    result.bounds.bottom = 0;
+  }
+
+  result.ssim = 0;
+  result.ms_ssim = 0;
+  result.mean_delta_e = 0;
+  result.max_delta_e = 0;
+  if (options.metrics) {
+    bool ssim = options.metrics & (CompareOptions::METRIC_SSIM | CompareOptions::METRIC_MS_SSIM);
+    bool delta_e = options.metrics & CompareOptions::METRIC_DELTA_E;
+    std::vector<float> luma1, luma2;
+    if (ssim) {
+      luma1.resize(size_t(width) * height);
+      luma2.resize(size_t(width) * height);
+    }
+    std::vector<stats_t> stripes(num_stripes);
+    pool.run(num_stripes, [&](size_t i) {
+      uint32_t y_begin = i * stripe_rows;
+      uint32_t y_end = std::min(y_begin + stripe_rows, height);
+      comparator.extract(&stripes[i], y_begin, y_end,
+                         ssim ? luma1.data() : nullptr,
+                         ssim ? luma2.data() : nullptr,
+                         delta_e);
+    });
+    if (delta_e) {
+      stats_t perceptual;
+      for (auto& stripe : stripes) {
+        perceptual.merge(stripe, 0);
+      }
+      result.mean_delta_e = perceptual.delta_e_sum / (double(width) * height);
+      result.max_delta_e = perceptual.max_delta_e;
+    }
+    if (ssim) {
+      ComputeSSIM(luma1, luma2, width, height, options, pool, result);
+    }
+  }
+
+  if (options.print_errors) {
+    for (auto& error : stats.errors) {
+      printf("Error: pixel mismatch at (%d, %d), first=0x%x, second=0x%x\n",
+             error.x, error.y, error.first.value, error.second.value);
+    }
+  }
+  result.errors.swap(stats.errors);
+
+  if (stats.mismatches && !diff_pixels.empty()) {
+    int ret = SaveImage(options.diff_filename, FORMAT_R8G8B8,
+                        diff_pixels.data(), width, height, width * 3);
+    if (ret)
+      return ret;
+  }
+
+  return 0;
+}
+
+int cocogfx::CompareImages(const char* filename1,
+                           const char* filename2,
+                           cocogfx::ePixelFormat format,
+                           CompareResult &result,
+                           const CompareOptions& options) {
+  int ret;
+  std::vector<uint8_t> image1_bits;
+  uint32_t image1_width;
+  uint32_t image1_height;
+
+  ret = cocogfx::LoadImage(filename1, format, image1_bits, &image1_width, &image1_height);
+  if (ret)
+    return ret;
+
+  int32_t pitch = image1_width * Format::GetInfo(format).BytePerPixel;
+  return CompareImages(filename2,
+                       image1_bits.data(),
+                       format,
+                       image1_width,
+                       image1_height,
+                       pitch,
+                       result,
+                       options);
+}
+
+int cocogfx::CompareImages(const char* filename,
+                           const uint8_t* pixels,
+                           cocogfx::ePixelFormat format,
+                           uint32_t width,
+                           uint32_t height,
+                           int32_t pitch,
+                           CompareResult &result,
+                           const CompareOptions& options) {
+  // decode straight to the in-memory format
+  std::vector<uint8_t> image_bits;
+  uint32_t image_width;
+  uint32_t image_height;
+  int ret = cocogfx::LoadImage(filename, format, image_bits, &image_width, &image_height);
+  if (ret)
+    return ret;
+
+  int32_t image_pitch = image_width * Format::GetInfo(format).BytePerPixel;
+  return CompareImages(pixels, format, width, height, pitch,
+                       image_bits.data(), format, image_width, image_height, image_pitch,
+                       result, options);
+}
+
+int cocogfx::CompareImages(const char* filename1,
+                           const char* filename2,
+                           cocogfx::ePixelFormat format,
+                           uint32_t tolerance,
+                           uint32_t max_errors) {
+  CompareOptions options;
+  options.tolerance  = tolerance;
+  // 0 has always meant no limit here
+  options.max_errors = max_errors ? max_errors : std::numeric_limits<uint32_t>::max();
+  options.print_errors = true;
+
+  CompareResult result;
+  int ret = CompareImages(filename1, filename2, format, result, options);
+  if (ret)
+    return ret;
+
+  if (max_errors && result.mismatches > max_errors)
+    return max_errors;
+  return result.mismatches;
+}
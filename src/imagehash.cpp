@@ -0,0 +1,287 @@
+#include "imagehash.hpp"
+#include "imageutil.hpp"
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+using namespace cocogfx;
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, 8);
+  return value;
+}
+
+static inline uint32_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t value) {
+  acc ^= xxh_round(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+Hasher64::Hasher64(uint64_t seed)
+  : seed_(seed)
+  , total_(0)
+  , buffered_(0) {
+  v_[0] = seed + PRIME64_1 + PRIME64_2;
+  v_[1] = seed + PRIME64_2;
+  v_[2] = seed;
+  v_[3] = seed - PRIME64_1;
+}
+
+void Hasher64::update(const void* data, size_t size) {
+  auto p = reinterpret_cast<const uint8_t*>(data);
+  auto end = p + size;
+  total_ += size;
+
+  if (buffered_ + size < 32) {
+    memcpy(buffer_ + buffered_, p, size);
+    buffered_ += size;
+    return;
+  }
+
+  if (buffered_) {
+    uint32_t fill = 32 - buffered_;
+    memcpy(buffer_ + buffered_, p, fill);
+    p += fill;
+    for (int i = 0; i < 4; ++i) {
+      v_[i] = xxh_round(v_[i], read64(buffer_ + 8 * i));
+    }
+    buffered_ = 0;
+  }
+
+  uint64_t v0 = v_[0], v1 = v_[1], v2 = v_[2], v3 = v_[3];
+  while (end - p >= 32) {
+    v0 = xxh_round(v0, read64(p + 0));
+    v1 = xxh_round(v1, read64(p + 8));
+    v2 = xxh_round(v2, read64(p + 16));
+    v3 = xxh_round(v3, read64(p + 24));
+    p += 32;
+  }
+  v_[0] = v0; v_[1] = v1; v_[2] = v2; v_[3] = v3;
+
+  buffered_ = end - p;
+  memcpy(buffer_, p, buffered_);
+}
+
+uint64_t Hasher64::digest() const {
+  uint64_t h;
+  if (total_ >= 32) {
+    h = rotl64(v_[0], 1) + rotl64(v_[1], 7) + rotl64(v_[2], 12) + rotl64(v_[3], 18);
+    for (int i = 0; i < 4; ++i) {
+      h = xxh_merge(h, v_[i]);
+    }
+  } else {
+    h = seed_ + PRIME64_5;
+  }
+  h += total_;
+
+  auto p = buffer_;
+  auto end = buffer_ + buffered_;
+  while (end - p >= 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    h ^= uint64_t(read32(p)) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p++) * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t cocogfx::HashImage(const uint8_t* pixels,
+                            ePixelFormat format,
+                            uint32_t width,
+                            uint32_t height,
+                            int32_t pitch) {
+  uint32_t row_size = width * Format::GetInfo(format).BytePerPixel;
+  uint64_t seed = (uint64_t(format) << 56) ^ (uint64_t(width) << 28) ^ height;
+  Hasher64 hasher(seed);
+  if (int32_t(row_size) == pitch) {
+    hasher.update(pixels, size_t(row_size) * height);
+  } else {
+    for (uint32_t y = 0; y < height; ++y) {
+      hasher.update(pixels + int64_t(y) * pitch, row_size);
+    }
+  }
+  return hasher.digest();
+}
+
+uint64_t cocogfx::PerceptualHashImage(const uint8_t* pixels,
+                                      ePixelFormat format,
+                                      uint32_t width,
+                                      uint32_t height,
+                                      int32_t pitch) {
+  if (0 == width || 0 == height)
+    return 0;
+
+  // box-filter the luma down to 9x8 cells
+  float sums[8][9] = {};
+  uint32_t counts[8][9] = {};
+  auto convert_from = Format::GetConvertFrom(format, true);
+  auto bpp = Format::GetInfo(format).BytePerPixel;
+  for (uint32_t y = 0; y < height; ++y) {
+    uint32_t cy = uint64_t(y) * 8 / height;
+    auto src = pixels + int64_t(y) * pitch;
+    for (uint32_t x = 0; x < width; ++x) {
+      uint32_t cx = uint64_t(x) * 9 / width;
+      auto color = convert_from(src);
+      sums[cy][cx] += 0.299f * color.r + 0.587f * color.g + 0.114f * color.b;
+      ++counts[cy][cx];
+      src += bpp;
+    }
+  }
+
+  float cells[8][9];
+  for (int y = 0; y < 8; ++y) {
+    for (int x = 0; x < 9; ++x) {
+      cells[y][x] = counts[y][x] ? (sums[y][x] / counts[y][x]) : 0.0f;
+    }
+  }
+
+  // one bit per horizontal gradient sign
+  uint64_t hash = 0;
+  for (int y = 0; y < 8; ++y) {
+    for (int x = 0; x < 8; ++x) {
+      hash = (hash << 1) | (cells[y][x] < cells[y][x + 1] ? 1 : 0);
+    }
+  }
+  return hash;
+}
+
+namespace {
+
+// Content-addressed table of live pixel buffers.
+class DedupTable {
+public:
+  static DedupTable& Instance() {
+    static DedupTable instance;
+    return instance;
+  }
+
+  std::shared_ptr<const std::vector<uint8_t>> intern(std::vector<uint8_t>&& pixels,
+                                                     ePixelFormat format,
+                                                     uint32_t width,
+                                                     uint32_t height,
+                                                     uint64_t hash) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto range = entries_.equal_range(hash);
+    for (auto it = range.first; it != range.second;) {
+      auto buffer = it->second.pixels.lock();
+      if (!buffer) {
+        it = entries_.erase(it);
+        continue;
+      }
+      if (it->second.format == format
+       && it->second.width == width
+       && it->second.height == height
+       && *buffer == pixels) {
+        return buffer;
+      }
+      ++it;
+    }
+
+    // drop expired entries once the table doubled since the last sweep
+    if (entries_.size() >= 2 * last_sweep_size_) {
+      for (auto it = entries_.begin(); it != entries_.end();) {
+        if (it->second.pixels.expired()) {
+          it = entries_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      last_sweep_size_ = std::max<size_t>(entries_.size(), 64);
+    }
+
+    std::shared_ptr<const std::vector<uint8_t>> buffer(
+      new std::vector<uint8_t>(std::move(pixels)));
+    entry_t entry;
+    entry.pixels = buffer;
+    entry.format = format;
+    entry.width  = width;
+    entry.height = height;
+    entries_.emplace(hash, entry);
+    return buffer;
+  }
+
+private:
+
+  struct entry_t {
+    std::weak_ptr<const std::vector<uint8_t>> pixels;
+    ePixelFormat format;
+    uint32_t width;
+    uint32_t height;
+  };
+
+  DedupTable() : last_sweep_size_(64) {}
+
+  std::unordered_multimap<uint64_t, entry_t> entries_;
+  size_t last_sweep_size_;
+  std::mutex mutex_;
+};
+
+}
+
+SharedImage cocogfx::InternImage(std::vector<uint8_t>&& pixels,
+                                 ePixelFormat format,
+                                 uint32_t width,
+                                 uint32_t height,
+                                 bool perceptual_hash) {
+  SharedImage image;
+  int32_t pitch = width * Format::GetInfo(format).BytePerPixel;
+  image.width  = width;
+  image.height = height;
+  image.format = format;
+  image.hash   = HashImage(pixels.data(), format, width, height, pitch);
+  if (perceptual_hash) {
+    image.perceptual_hash = PerceptualHashImage(pixels.data(), format, width, height, pitch);
+  }
+  image.pixels = DedupTable::Instance().intern(std::move(pixels), format, width, height, image.hash);
+  return image;
+}
+
+int cocogfx::LoadSharedImage(const char *filename,
+                             ePixelFormat format,
+                             SharedImage *image,
+                             bool perceptual_hash) {
+  std::vector<uint8_t> pixels;
+  uint32_t width;
+  uint32_t height;
+  int ret = LoadImage(filename, format, pixels, &width, &height);
+  if (ret)
+    return ret;
+  *image = InternImage(std::move(pixels), format, width, height, perceptual_hash);
+  return 0;
+}
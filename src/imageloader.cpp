@@ -0,0 +1,142 @@
+#include "imageutil.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+using namespace cocogfx;
+
+namespace {
+
+struct file_t {
+  size_t index;
+  int status;
+  std::vector<uint8_t> data;
+};
+
+// Bounded queue between the reader and the decode threads, limiting how
+// many encoded files are held in memory.
+class FileQueue {
+public:
+  FileQueue(size_t capacity)
+    : capacity_(capacity)
+    , closed_(false)
+  {}
+
+  void push(file_t&& file) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [&]() { return files_.size() < capacity_; });
+    files_.push_back(std::move(file));
+    not_empty_.notify_one();
+  }
+
+  bool pop(file_t* file) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [&]() { return !files_.empty() || closed_; });
+    if (files_.empty())
+      return false;
+    *file = std::move(files_.front());
+    files_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+private:
+  std::deque<file_t> files_;
+  size_t capacity_;
+  bool closed_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+int ReadFile(const char* filename, std::vector<uint8_t>& data) {
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  ifs.seekg(0, std::ios::end);
+  auto size = ifs.tellg();
+  ifs.seekg(0, std::ios::beg);
+  if (size < 0) {
+    std::cerr << "couldn't read file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  data.resize(size_t(size));
+  if (!ifs.read(reinterpret_cast<char*>(data.data()), size)) {
+    std::cerr << "couldn't read file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+}
+
+int cocogfx::LoadImages(const std::vector<std::string>& filenames,
+                        ePixelFormat format,
+                        const LoadImageCallback& callback,
+                        uint32_t num_threads) {
+  if (0 == num_threads) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::max<uint32_t>(1, std::min<size_t>(num_threads, filenames.size()));
+
+  // two files in flight per decode thread
+  FileQueue queue(2 * num_threads);
+
+  std::thread reader([&]() {
+    for (size_t i = 0; i < filenames.size(); ++i) {
+      file_t file;
+      file.index  = i;
+      file.status = ReadFile(filenames[i].c_str(), file.data);
+      queue.push(std::move(file));
+    }
+    queue.close();
+  });
+
+  std::atomic<int> failures(0);
+  auto decode = [&]() {
+    file_t file;
+    while (queue.pop(&file)) {
+      LoadImageResult result;
+      result.index  = file.index;
+      result.status = file.status;
+      result.width  = 0;
+      result.height = 0;
+      if (0 == result.status) {
+        result.status = LoadImage(file.data.data(), file.data.size(), format,
+                                  result.pixels, &result.width, &result.height);
+      }
+      // release the encoded data before running the callback
+      std::vector<uint8_t>().swap(file.data);
+      if (result.status) {
+        ++failures;
+      }
+      callback(filenames[result.index], result);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (uint32_t t = 1; t < num_threads; ++t) {
+    workers.emplace_back(decode);
+  }
+  decode();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  reader.join();
+
+  return failures;
+}
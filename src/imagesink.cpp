@@ -0,0 +1,49 @@
+#include "imagesink.hpp"
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+using namespace cocogfx;
+
+ImageBufferSink::ImageBufferSink(std::vector<uint8_t>& pixels)
+  : pixels_(pixels)
+  , width_(0)
+  , height_(0)
+  , format_(FORMAT_UNKNOWN)
+{}
+
+int ImageBufferSink::begin(uint32_t width,
+                           uint32_t height,
+                           ePixelFormat format) {
+  auto bpp = Format::GetInfo(format).BytePerPixel;
+  if (0 == bpp) {
+    std::cerr << "unsupported pixel format: " << format << "!" << std::endl;
+    return -1;
+  }
+  size_t row_size = size_t(width) * bpp;
+  if (height && row_size > SIZE_MAX / height) {
+    std::cerr << "image too large: " << width << "x" << height << "!" << std::endl;
+    return -1;
+  }
+  pixels_.resize(row_size * height);
+  width_  = width;
+  height_ = height;
+  format_ = format;
+  return 0;
+}
+
+int ImageBufferSink::writeRows(const uint8_t* rows,
+                               uint32_t y,
+                               uint32_t count,
+                               int32_t pitch) {
+  if (uint64_t(y) + count > height_)
+    return -1;
+  size_t row_size = size_t(width_) * Format::GetInfo(format_).BytePerPixel;
+  auto dst = pixels_.data() + size_t(y) * row_size;
+  for (uint32_t i = 0; i < count; ++i) {
+    memcpy(dst, rows, row_size);
+    dst  += row_size;
+    rows += pitch;
+  }
+  return 0;
+}
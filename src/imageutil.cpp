@@ -3,8 +3,10 @@
 #include "tga.hpp"
 #include "png.hpp"
 #include "bmp.hpp"
+#include "membuf.hpp"
+#include <cstring>
+#include <fstream>
 #include <iostream>
-#include <iomanip>
 
 using namespace cocogfx;
 
@@ -27,164 +29,477 @@ static bool iequals(const std::string& a, const std::string& b) {
   return true;
 }
 
-int cocogfx::LoadImage(const char *filename,
-                       ePixelFormat format,
-                       std::vector<uint8_t> &pixels,
-                       uint32_t *width,
-                       uint32_t *height) {
-  uint32_t img_width;
-  uint32_t img_height;
-  uint32_t img_bpp;
+namespace {
 
-  auto ext = getFileExt(filename);
-  if (iequals(ext, "tga")) {
-    int ret = LoadTGA(filename, pixels, &img_width, &img_height, &img_bpp);
-    if (ret)
-      return ret;
-  } else
-  if (iequals(ext, "png")) {
-    int ret = LoadPNG(filename, pixels, &img_width, &img_height, &img_bpp);
-    if (ret)
-      return ret;
-  } else
-  if (iequals(ext, "bmp")) {
-    int ret = LoadBMP(filename, pixels, &img_width, &img_height, &img_bpp);
+// Converts streamed rows to the requested format before forwarding them.
+class ConvertSink : public ImageSink {
+public:
+  ConvertSink(ImageSink& target, ePixelFormat format)
+    : target_(target)
+    , dst_format_(format)
+    , src_format_(FORMAT_UNKNOWN)
+    , width_(0)
+  {}
+
+  int begin(uint32_t width,
+            uint32_t height,
+            ePixelFormat format) override {
+    if (FORMAT_UNKNOWN == format) {
+      std::cerr << "unsupported image format!" << std::endl;
+      return -1;
+    }
+    src_format_ = format;
+    width_ = width;
+    return target_.begin(width, height, dst_format_);
+  }
+
+  int writeRows(const uint8_t* rows,
+                uint32_t y,
+                uint32_t count,
+                int32_t pitch) override {
+    if (src_format_ == dst_format_)
+      return target_.writeRows(rows, y, count, pitch);
+    int ret = ConvertImage(staging_, dst_format_, rows, src_format_, width_, count, pitch);
     if (ret)
       return ret;
-  } else {
-    std::cerr << "invalid file extension: " << ext << "!" << std::endl;
+    return target_.writeRows(staging_.data(), y, count, staging_.size() / count);
+  }
+
+  int finish() override {
+    return target_.finish();
+  }
+
+private:
+  ImageSink& target_;
+  ePixelFormat dst_format_;
+  ePixelFormat src_format_;
+  uint32_t width_;
+  std::vector<uint8_t> staging_;
+};
+
+}
+
+static eImageType GetImageTypeFromExt(const char *filename) {
+  auto ext = getFileExt(filename);
+  if (iequals(ext, "tga"))
+    return IMAGE_TGA;
+  if (iequals(ext, "png"))
+    return IMAGE_PNG;
+  if (iequals(ext, "bmp"))
+    return IMAGE_BMP;
+  std::cerr << "invalid file extension: " << ext << "!" << std::endl;
+  return IMAGE_UNKNOWN;
+}
+
+static eImageType GetImageTypeFromContent(const uint8_t* header, size_t size) {
+  static const uint8_t png_sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  if (size >= 8 && 0 == memcmp(header, png_sig, 8))
+    return IMAGE_PNG;
+  if (size >= 2 && 'B' == header[0] && 'M' == header[1])
+    return IMAGE_BMP;
+  // TGA has no signature, accept uncompressed true-color headers
+  if (size >= 18 && 0 == header[1] && 2 == header[2]
+   && (16 == header[16] || 24 == header[16] || 32 == header[16]))
+    return IMAGE_TGA;
+  return IMAGE_UNKNOWN;
+}
+
+static int ProbeNativeImage(std::istream &is, ImageInfo *info) {
+  switch (info->type) {
+  case IMAGE_TGA:
+    return ProbeTGA(is, &info->width, &info->height, &info->channels, &info->format);
+  case IMAGE_PNG:
+    return ProbePNG(is, &info->width, &info->height, &info->channels, &info->format);
+  case IMAGE_BMP:
+    return ProbeBMP(is, &info->width, &info->height, &info->channels, &info->format);
+  default:
+    std::cerr << "unsupported image format!" << std::endl;
     return -1;
   }
+}
 
-  ePixelFormat img_format;
-  switch (img_bpp) {
-  case 1:
-    img_format = FORMAT_A8;
-    break;
-  case 2:
-    img_format = FORMAT_R5G6B5;
-    break;
-  case 3:
-    img_format = FORMAT_R8G8B8;
-    break;
-  case 4:
-    img_format = FORMAT_A8R8G8B8;
-    break;
+int cocogfx::ProbeImage(std::istream &is, ImageInfo *info) {
+  uint8_t header[18];
+  auto start = is.tellg();
+  is.read(reinterpret_cast<char*>(header), sizeof(header));
+  size_t size = is.gcount();
+  is.clear();
+  if (!is.seekg(start)) {
+    std::cerr << "image stream is not seekable!" << std::endl;
+    return -1;
+  }
+
+  // the backend probes read the stream directly, PNG may need to skip over
+  // ancillary chunks to find the transparency chunk
+  info->type = GetImageTypeFromContent(header, size);
+  int ret = ProbeNativeImage(is, info);
+  is.clear();
+  is.seekg(start);
+  return ret;
+}
+
+int cocogfx::QueryImageInfo(const char *filename, ImageInfo *info) {
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
+  }
+  return ProbeImage(ifs, info);
+}
+
+static int LoadNativeImage(std::istream &is, ImageSink &sink) {
+  ImageInfo info;
+  int ret = ProbeImage(is, &info);
+  if (ret)
+    return ret;
+
+  switch (info.type) {
+  case IMAGE_TGA:
+    return LoadTGA(is, sink);
+  case IMAGE_PNG:
+    return LoadPNG(is, sink);
+  case IMAGE_BMP:
+    return LoadBMP(is, sink);
   default:
-    std::abort();
+    return -1;
   }
+}
 
-  if (img_format != format) {
-    // format conversion to RGBA
-    std::vector<uint8_t> staging;
-    int ret = ConvertImage(staging, format, pixels.data(), img_format, img_width, img_height, img_width * img_bpp);
-    if (ret)
-      return ret;
-    pixels.swap(staging);
+static int LoadNativeImage(const char *filename, ImageSink &sink) {
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    std::cerr << "couldn't open file: " << filename << "!" << std::endl;
+    return -1;
   }
+  return LoadNativeImage(ifs, sink);
+}
 
-  *width  = img_width;
-  *height = img_height;
+int cocogfx::LoadImage(const char *filename,
+                       ePixelFormat format,
+                       std::vector<uint8_t> &pixels,
+                       uint32_t *width,
+                       uint32_t *height) {
+  // format conversion is applied per band while decoding
+  ImageBufferSink buffer(pixels);
+  ConvertSink sink(buffer, format);
+  int ret = LoadNativeImage(filename, sink);
+  if (ret)
+    return ret;
+
+  *width  = buffer.width();
+  *height = buffer.height();
 
   return 0;
 }
 
+int cocogfx::LoadImage(const char *filename,
+                       ePixelFormat format,
+                       ImageSink &sink) {
+  ConvertSink convert(sink, format);
+  return LoadNativeImage(filename, convert);
+}
+
+int cocogfx::LoadImage(const uint8_t* data,
+                       size_t size,
+                       ePixelFormat format,
+                       std::vector<uint8_t> &pixels,
+                       uint32_t *width,
+                       uint32_t *height) {
+  ImageBufferSink buffer(pixels);
+  int ret = LoadImage(data, size, format, buffer);
+  if (ret)
+    return ret;
+
+  *width  = buffer.width();
+  *height = buffer.height();
+
+  return 0;
+}
+
+int cocogfx::LoadImage(const uint8_t* data,
+                       size_t size,
+                       ePixelFormat format,
+                       ImageSink &sink) {
+  MemoryStreamBuf buf(data, size);
+  std::istream is(&buf);
+  return LoadImage(is, format, sink);
+}
+
+int cocogfx::LoadImage(std::istream &is,
+                       ePixelFormat format,
+                       ImageSink &sink) {
+  ConvertSink convert(sink, format);
+  return LoadNativeImage(is, convert);
+}
+
 int cocogfx::SaveImage(const char *filename,
                        ePixelFormat format,
                        const uint8_t* pixels,
                        uint32_t width,
                        uint32_t height,
-                       int32_t pitch) {
-  uint32_t bpp = Format::GetInfo(format).BytePerPixel;
-  auto ext = getFileExt(filename);
-  if (iequals(ext, "tga")) {
-    return SaveTGA(filename, pixels, width, height, bpp, pitch);
-  } else
-  if (iequals(ext, "png")) {
-    return SavePNG(filename, pixels, width, height, bpp, pitch);
-  } else
-  if (iequals(ext, "bmp")) {
-    return SaveBMP(filename, pixels, width, height, bpp, pitch);
-  } else {
-    std::cerr << "invalid file extension: " << ext << "!" << std::endl;
-    return -1;
-  }
+                       int32_t pitch,
+                       const PNGOptions& png_options) {
+  ImageWriter writer(filename, png_options);
+  int ret = writer.begin(width, height, format);
+  if (ret)
+    return ret;
 
-  return 0;
-}
+  ret = writer.writeRows(pixels, 0, height, pitch);
+  if (ret)
+    return ret;
 
-void cocogfx::DumpImage(const std::vector<uint8_t>& pixels, uint32_t width, uint32_t height, uint32_t bpp) {
-  assert(width * height * bpp == pixels.size());
-  const uint8_t* pixel_bytes = pixels.data();
-  for (uint32_t y = 0; y < height; ++y) {
-    for (uint32_t x = 0; x < width; ++x) {
-      uint32_t pixel32 = 0;
-      for (uint32_t b = 0; b < bpp; ++b) {
-        uint32_t pixel8 = *pixel_bytes++;
-        pixel32 |= pixel8 << (b * 8);
-      }
-      if (x) std::cout << ", ";
-      std::cout << std::hex << std::setw(bpp * 2) << std::setfill('0') << pixel32;
-    }
-    std::cout << std::endl;
-  }
+  return writer.finish();
 }
 
-int cocogfx::CompareImages(const char* filename1,
-                           const char* filename2,
-                           cocogfx::ePixelFormat format,
-                           uint32_t tolerance,
-                           uint32_t max_errors) {
-  int ret;
-  std::vector<uint8_t> image1_bits;
-  uint32_t image1_width;
-  uint32_t image1_height;
-
-  std::vector<uint8_t> image2_bits;
-  uint32_t image2_width;
-  uint32_t image2_height;
+int cocogfx::SaveImage(std::vector<uint8_t> &data,
+                       eImageType type,
+                       ePixelFormat format,
+                       const uint8_t* pixels,
+                       uint32_t width,
+                       uint32_t height,
+                       int32_t pitch,
+                       const PNGOptions& png_options) {
+  VectorStreamBuf buf(data);
+  std::ostream os(&buf);
+  return SaveImage(os, type, format, pixels, width, height, pitch, png_options);
+}
 
-  ret = cocogfx::LoadImage(filename1, format, image1_bits, &image1_width, &image1_height);
+int cocogfx::SaveImage(std::ostream &os,
+                       eImageType type,
+                       ePixelFormat format,
+                       const uint8_t* pixels,
+                       uint32_t width,
+                       uint32_t height,
+                       int32_t pitch,
+                       const PNGOptions& png_options) {
+  ImageWriter writer(os, type, png_options);
+  int ret = writer.begin(width, height, format);
   if (ret)
     return ret;
 
-  ret = cocogfx::LoadImage(filename2, format, image2_bits, &image2_width, &image2_height);
+  ret = writer.writeRows(pixels, 0, height, pitch);
   if (ret)
     return ret;
 
-  if (image1_bits.size() != image2_bits.size())
+  return writer.finish();
+}
+
+ImageWriter::ImageWriter(const char *filename,
+                         const PNGOptions& png_options) {
+  switch (GetImageTypeFromExt(filename)) {
+  case IMAGE_TGA:
+    writer_.reset(new TGAWriter(filename));
+    break;
+  case IMAGE_PNG:
+    writer_.reset(new PNGWriter(filename, png_options));
+    break;
+  case IMAGE_BMP:
+    writer_.reset(new BMPWriter(filename));
+    break;
+  default:
+    break;
+  }
+}
+
+ImageWriter::ImageWriter(std::ostream &os,
+                         eImageType type,
+                         const PNGOptions& png_options) {
+  switch (type) {
+  case IMAGE_TGA:
+    writer_.reset(new TGAWriter(os));
+    break;
+  case IMAGE_PNG:
+    writer_.reset(new PNGWriter(os, png_options));
+    break;
+  case IMAGE_BMP:
+    writer_.reset(new BMPWriter(os));
+    break;
+  default:
+    std::cerr << "invalid image type: " << type << "!" << std::endl;
+    break;
+  }
+}
+
+int ImageWriter::begin(uint32_t width,
+                       uint32_t height,
+                       ePixelFormat format) {
+  if (!writer_)
     return -1;
+  return writer_->begin(width, height, format);
+}
 
-  if (image1_width != image2_width)
+int ImageWriter::writeRows(const uint8_t* rows,
+                           uint32_t y,
+                           uint32_t count,
+                           int32_t pitch) {
+  if (!writer_)
     return -1;
+  return writer_->writeRows(rows, y, count, pitch);
+}
 
-  if (image1_height != image2_height)
+int ImageWriter::finish() {
+  if (!writer_)
     return -1;
+  return writer_->finish();
+}
+
+namespace {
+
+// Formats pixels through a hex lookup table into a large buffer that is
+// handed to the output in blocks.
+class ImageDumper {
+public:
+  ImageDumper(ePixelFormat format, const DumpOptions& options)
+    : format_(format)
+    , options_(options)
+    , bpp_(Format::GetInfo(format).BytePerPixel)
+    , convert_from_(Format::GetConvertFrom(format, false))
+    , buffer_(256 * 1024)
+    , size_(0) {
+    auto& info = Format::GetInfo(format);
+    num_channels_ = 0;
+    if (info.Luminance) {
+      channels_[num_channels_++] = 2; // luminance is replicated in red
+    } else {
+      if (info.Red)   channels_[num_channels_++] = 2;
+      if (info.Green) channels_[num_channels_++] = 1;
+      if (info.Blue)  channels_[num_channels_++] = 0;
+    }
+    if (info.Alpha) channels_[num_channels_++] = 3;
+    if (0 == num_channels_) {
+      options_.mode = DumpOptions::DUMP_RAW;
+    }
+  }
+
+  template <typename W>
+  int dump(const W& write,
+           const uint8_t* pixels,
+           uint32_t width,
+           uint32_t height,
+           int32_t pitch) {
+    if (0 == bpp_) {
+      std::cerr << "unsupported pixel format: " << format_ << "!" << std::endl;
+      return -1;
+    }
+    if (options_.x > width || options_.y > height)
+      return -1;
+
+    uint32_t region_width = width - options_.x;
+    uint32_t region_height = height - options_.y;
+    if (options_.width)
+      region_width = std::min(region_width, options_.width);
+    if (options_.height)
+      region_height = std::min(region_height, options_.height);
+
+    // worst case line size
+    uint32_t pixel_size = (DumpOptions::DUMP_RAW == options_.mode) ? (2 * bpp_) : (3 * num_channels_);
+    size_t line_size = size_t(region_width) * (pixel_size + 2) + 1;
+    if (buffer_.size() < line_size) {
+      buffer_.resize(line_size);
+    }
 
-  int errors = 0;
-  {
-    auto convert_from = Format::GetConvertFrom(format, true);
-    auto bpp = Format::GetInfo(format).BytePerPixel;
-    auto pixels1 = image1_bits.data();
-    auto pixels2 = image2_bits.data();
-    for (uint32_t y = 0; y < image1_height; ++y) {
-      for (uint32_t x = 0; x < image1_width; ++x) {
-        auto color1 = convert_from(pixels1);
-        auto color2 = convert_from(pixels2);
-        if (abs(color1.r - color2.r) > tolerance
-         || abs(color1.g - color2.g) > tolerance
-         || abs(color1.b - color2.b) > tolerance
-         || abs(color1.a - color2.a) > tolerance) {
-          printf("Error: pixel mismatch at (%d, %d), first=0x%x, second=0x%x\n", x, y, color1.value, color2.value);
-          ++errors;
-          if (errors == max_errors)
-            return errors;
+    auto hex = GetHexTable();
+    for (uint32_t y = 0; y < region_height; ++y) {
+      if (size_ + line_size > buffer_.size()) {
+        if (this->flush(write))
+          return -1;
+      }
+      auto src = pixels + int64_t(options_.y + y) * pitch + options_.x * bpp_;
+      auto dst = buffer_.data() + size_;
+      for (uint32_t x = 0; x < region_width; ++x) {
+        if (x) {
+          *dst++ = ',';
+          *dst++ = ' ';
+        }
+        if (DumpOptions::DUMP_RAW == options_.mode) {
+          for (uint32_t b = bpp_; b--;) {
+            memcpy(dst, hex[src[b]], 2);
+            dst += 2;
+          }
+        } else {
+          auto color = convert_from_(src);
+          for (uint32_t c = 0; c < num_channels_; ++c) {
+            if (c) {
+              *dst++ = ':';
+            }
+            memcpy(dst, hex[color.m[channels_[c]]], 2);
+            dst += 2;
+          }
         }
-        pixels1 += bpp;
-        pixels2 += bpp;
+        src += bpp_;
       }
+      *dst++ = '\n';
+      size_ = dst - buffer_.data();
     }
+
+    return this->flush(write);
+  }
+
+private:
+
+  typedef char hex_t[2];
+
+  static const hex_t* GetHexTable() {
+    static const struct table_t {
+      hex_t entries[256];
+      table_t() {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 256; ++i) {
+          entries[i][0] = digits[i >> 4];
+          entries[i][1] = digits[i & 0xf];
+        }
+      }
+    } table;
+    return table.entries;
   }
 
-  return errors;
-}
\ No newline at end of file
+  template <typename W>
+  int flush(const W& write) {
+    int ret = write(buffer_.data(), size_);
+    size_ = 0;
+    return ret;
+  }
+
+  ePixelFormat format_;
+  DumpOptions options_;
+  uint32_t bpp_;
+  Format::pfn_convert_from convert_from_;
+  uint32_t channels_[4];
+  uint32_t num_channels_;
+  std::vector<char> buffer_;
+  size_t size_;
+};
+
+}
+
+int cocogfx::DumpImage(FILE* out,
+                       const uint8_t* pixels,
+                       ePixelFormat format,
+                       uint32_t width,
+                       uint32_t height,
+                       int32_t pitch,
+                       const DumpOptions& options) {
+  ImageDumper dumper(format, options);
+  return dumper.dump([out](const char* data, size_t size)->int {
+    return (fwrite(data, 1, size, out) == size) ? 0 : -1;
+  }, pixels, width, height, pitch);
+}
+
+int cocogfx::DumpImage(std::ostream &os,
+                       const uint8_t* pixels,
+                       ePixelFormat format,
+                       uint32_t width,
+                       uint32_t height,
+                       int32_t pitch,
+                       const DumpOptions& options) {
+  ImageDumper dumper(format, options);
+  return dumper.dump([&os](const char* data, size_t size)->int {
+    return os.write(data, size) ? 0 : -1;
+  }, pixels, width, height, pitch);
+}
+
+void cocogfx::DumpImage(const std::vector<uint8_t>& pixels, uint32_t width, uint32_t height, uint32_t bpp) {
+  assert(width * height * bpp == pixels.size());
+  DumpImage(std::cout, pixels.data(), GetImageFormat(bpp), width, height, width * bpp);
+  std::cout.flush();
+}
@@ -1,33 +1,142 @@
 #include "png.hpp"
 #include "png.h"
+#include "zlib.h"
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <future>
+#include <thread>
 #include <fstream>
 #include <iostream>
-#include <iostream>
 
 using namespace cocogfx;
 
+static_assert(PNGOptions::FILTER_NONE == PNG_FILTER_NONE
+           && PNGOptions::FILTER_SUB == PNG_FILTER_SUB
+           && PNGOptions::FILTER_UP == PNG_FILTER_UP
+           && PNGOptions::FILTER_AVG == PNG_FILTER_AVG
+           && PNGOptions::FILTER_PAETH == PNG_FILTER_PAETH
+           && PNGOptions::FILTER_ALL == PNG_ALL_FILTERS, "invalid filter value");
+
+static_assert(PNGOptions::STRATEGY_DEFAULT == Z_DEFAULT_STRATEGY
+           && PNGOptions::STRATEGY_FILTERED == Z_FILTERED
+           && PNGOptions::STRATEGY_HUFFMAN_ONLY == Z_HUFFMAN_ONLY
+           && PNGOptions::STRATEGY_RLE == Z_RLE
+           && PNGOptions::STRATEGY_FIXED == Z_FIXED, "invalid strategy value");
+
 static void pngfile_error(png_structp /*png*/, png_const_charp msg) {
 	std::cerr << msg << std::endl;
 }
 
+static void pngstream_read(png_structp png, png_bytep data, png_size_t size) {
+  auto is = reinterpret_cast<std::istream*>(png_get_io_ptr(png));
+  if (!is->read(reinterpret_cast<char*>(data), size))
+    png_error(png, "png read error!");
+}
+
+static void pngstream_write(png_structp png, png_bytep data, png_size_t size) {
+  auto os = reinterpret_cast<std::ostream*>(png_get_io_ptr(png));
+  if (!os->write(reinterpret_cast<const char*>(data), size))
+    png_error(png, "png write error!");
+}
+
+static void pngstream_flush(png_structp png) {
+  auto os = reinterpret_cast<std::ostream*>(png_get_io_ptr(png));
+  os->flush();
+}
+
 int cocogfx::LoadPNG(const char *filename, 
                      std::vector<uint8_t> &pixels, 
                      uint32_t *width,
                      uint32_t *height,
                      uint32_t *bpp) {
+  ImageBufferSink sink(pixels);
+  int ret = LoadPNG(filename, sink);
+  if (ret)
+    return ret;
+
+  *width  = sink.width();
+	*height = sink.height();
+  *bpp    = Format::GetInfo(sink.format()).BytePerPixel;
+                       
+  return 0;
+}
+
+int cocogfx::LoadPNG(const char *filename, 
+                     ImageSink &sink) {
   // open file
-  auto file = fopen(filename, "rb");
-  if (nullptr == file) {
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
     std::cerr << "couldn't open file: " << filename << "!" << std::endl;
     return -1;
   }
+  return LoadPNG(ifs, sink);
+}
 
+int cocogfx::ProbePNG(std::istream &is, 
+                      uint32_t *width,
+                      uint32_t *height,
+                      uint32_t *channels,
+                      ePixelFormat *format) {
+  // signature followed by the IHDR chunk
+  png_byte header[8 + 8 + 13 + 4];
+  if (!is.read(reinterpret_cast<char*>(header), sizeof(header))
+   || !png_check_sig(header, 8)
+   || 0 != memcmp(header + 12, "IHDR", 4)) {
+    std::cerr << "invalid png file signature!" << std::endl;
+    return -1;
+  }
+
+  auto ihdr = header + 16;
+  int colorType = ihdr[9];
+
+  // look for a transparency chunk before the image data,
+  // only chunk headers are read
+  bool has_trns = false;
+  for (;;) {
+    png_byte chunk[8];
+    if (!is.read(reinterpret_cast<char*>(chunk), sizeof(chunk)))
+      break;
+    if (0 == memcmp(chunk + 4, "tRNS", 4)) {
+      has_trns = true;
+      break;
+    }
+    if (0 == memcmp(chunk + 4, "IDAT", 4))
+      break;
+    if (!is.seekg(png_get_uint_32(chunk) + 4, std::ios::cur))
+      break;
+  }
+
+  uint32_t file_channels;
+  switch (colorType) {
+  case PNG_COLOR_TYPE_GRAY:       file_channels = has_trns ? 2 : 1; break;
+  case PNG_COLOR_TYPE_GRAY_ALPHA: file_channels = 2; break;
+  case PNG_COLOR_TYPE_RGB:        file_channels = has_trns ? 4 : 3; break;
+  case PNG_COLOR_TYPE_PALETTE:    file_channels = has_trns ? 4 : 3; break;
+  case PNG_COLOR_TYPE_RGB_ALPHA:  file_channels = 4; break;
+  default:
+    std::cerr << "invalid png color type!" << std::endl;
+    return -1;
+  }
+
+  // LoadPNG expands gray with alpha to BGRA
+  uint32_t bpp = (2 == file_channels) ? 4 : file_channels;
+
+  *width    = png_get_uint_32(ihdr + 0);
+  *height   = png_get_uint_32(ihdr + 4);
+  *channels = file_channels;
+  *format   = GetImageFormat(bpp);
+
+  return 0;
+}
+
+int cocogfx::LoadPNG(std::istream &is, 
+                     ImageSink &sink) {
   // check signature
   png_byte pbSig[8];
-  if (fread(pbSig, 1, 8, file) != 8
+  if (!is.read(reinterpret_cast<char*>(pbSig), 8)
    || !png_check_sig(pbSig, 8)) {
-    fclose(file);
     std::cerr << "invalid png file signature!" << std::endl;
     return -1;
 	}
@@ -36,18 +145,24 @@ int cocogfx::LoadPNG(const char *filename,
   auto png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
       (png_error_ptr)pngfile_error, (png_error_ptr)NULL);
 	if (!png) {
-    fclose(file);
 		return -1;
 	}
 
 	auto png_info = png_create_info_struct(png);
 	if (!png_info) {
 		png_destroy_read_struct(&png, NULL, NULL);
-    fclose(file);
 		return -1;
 	}
 
-	png_init_io(png, file);
+  std::vector<uint8_t> row;
+
+  // libpng errors return here
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &png_info, NULL);
+    return -1;
+  }
+
+	png_set_read_fn(png, &is, pngstream_read);
 	png_set_sig_bytes(png, 8);
 
 	// read PNG info
@@ -71,9 +186,15 @@ int cocogfx::LoadPNG(const char *filename,
 		png_set_expand(png);
 
   // if there is a transparency palette, create alpha channel
-	if (png_get_valid(png, png_info, PNG_INFO_tRNS))
+  bool has_trns = png_get_valid(png, png_info, PNG_INFO_tRNS);
+	if (has_trns)
 		png_set_expand(png);
 
+  // expand gray with alpha to RGBA
+  if (colorType == PNG_COLOR_TYPE_GRAY_ALPHA
+   || (colorType == PNG_COLOR_TYPE_GRAY && has_trns))
+    png_set_gray_to_rgb(png);
+
   // use BGR order
 	png_set_bgr(png);
 
@@ -82,25 +203,24 @@ int cocogfx::LoadPNG(const char *filename,
   png_get_IHDR(png, png_info, &pwidth, &pheight, &depth, &colorType, NULL, NULL, NULL);
   channels = png_get_channels(png, png_info);
 
-	// read pixels
+  int ret = sink.begin(pwidth, pheight, GetImageFormat(channels));
+
+	// read pixels one row at a time
   uint32_t pitch = pwidth * channels;
-  pixels.resize(pheight * pitch);
-  auto dst_rows = pixels.data();
-  for (uint32_t y = 0; y < pheight; ++y) {
-    png_read_row(png, dst_rows, NULL);
-    dst_rows += pitch;
+  row.resize(pitch);
+  for (uint32_t y = 0; !ret && y < pheight; ++y) {
+    png_read_row(png, row.data(), NULL);
+    ret = sink.writeRows(row.data(), y, 1, pitch);
   }	
-  png_read_end(png, png_info);
+  if (!ret)
+    png_read_end(png, png_info);
 
 	png_destroy_read_struct(&png, &png_info, NULL);
 
-	fclose(file);
-
-  *width  = pwidth;
-	*height = pheight;
-  *bpp    = channels;
+  if (ret)
+    return ret;
                        
-  return 0;
+  return sink.finish();
 }
 
 int cocogfx::SavePNG(const char *filename, 
@@ -108,54 +228,537 @@ int cocogfx::SavePNG(const char *filename,
                      uint32_t width,
                      uint32_t height, 
                      uint32_t bpp,
-                     int32_t pitch) {
-  FILE *file = fopen(filename, "wb");
-  if (nullptr == file) {
-    std::cerr << "couldn't create file: " << filename << "!" << std::endl;
+                     int32_t pitch,
+                     const PNGOptions& options) {
+  PNGWriter writer(filename, options);
+  int ret = writer.begin(width, height, GetImageFormat(bpp));
+  if (ret)
+    return ret;
+
+  ret = writer.writeRows(pixels, 0, height, pitch);
+  if (ret)
+    return ret;
+
+  return writer.finish();
+}
+
+namespace {
+
+// PNG filter types
+enum {
+  FILTER_TYPE_NONE,
+  FILTER_TYPE_SUB,
+  FILTER_TYPE_UP,
+  FILTER_TYPE_AVG,
+  FILTER_TYPE_PAETH,
+};
+
+inline uint8_t paeth_predictor(int a, int b, int c) {
+  int p  = a + b - c;
+  int pa = std::abs(p - a);
+  int pb = std::abs(p - b);
+  int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return (pb <= pc) ? b : c;
+}
+
+void filter_row(uint8_t* dst,
+                int type,
+                const uint8_t* cur,
+                const uint8_t* prev,
+                uint32_t row_size,
+                uint32_t bpp) {
+  *dst++ = type;
+  switch (type) {
+  case FILTER_TYPE_NONE:
+    memcpy(dst, cur, row_size);
+    break;
+  case FILTER_TYPE_SUB:
+    for (uint32_t i = 0; i < bpp; ++i)
+      dst[i] = cur[i];
+    for (uint32_t i = bpp; i < row_size; ++i)
+      dst[i] = cur[i] - cur[i - bpp];
+    break;
+  case FILTER_TYPE_UP:
+    for (uint32_t i = 0; i < row_size; ++i)
+      dst[i] = cur[i] - prev[i];
+    break;
+  case FILTER_TYPE_AVG:
+    for (uint32_t i = 0; i < bpp; ++i)
+      dst[i] = cur[i] - (prev[i] >> 1);
+    for (uint32_t i = bpp; i < row_size; ++i)
+      dst[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+    break;
+  case FILTER_TYPE_PAETH:
+    for (uint32_t i = 0; i < bpp; ++i)
+      dst[i] = cur[i] - prev[i];
+    for (uint32_t i = bpp; i < row_size; ++i)
+      dst[i] = cur[i] - paeth_predictor(cur[i - bpp], prev[i], prev[i - bpp]);
+    break;
+  }
+}
+
+// sum of absolute differences heuristic, same as libpng
+uint32_t filter_cost(const uint8_t* filtered, uint32_t row_size) {
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < row_size; ++i) {
+    int v = (int8_t)filtered[i];
+    sum += std::abs(v);
+  }
+  return sum;
+}
+
+void write_be32(uint8_t* dst, uint32_t value) {
+  dst[0] = (value >> 24) & 0xff;
+  dst[1] = (value >> 16) & 0xff;
+  dst[2] = (value >> 8) & 0xff;
+  dst[3] = value & 0xff;
+}
+
+int write_chunk(std::ostream& os, const char* type, const uint8_t* data, uint32_t size) {
+  uint8_t header[8];
+  write_be32(header, size);
+  memcpy(header + 4, type, 4);
+  uint32_t crc = crc32(0, header + 4, 4);
+  if (size)
+    crc = crc32(crc, data, size);
+  uint8_t footer[4];
+  write_be32(footer, crc);
+  if (!os.write(reinterpret_cast<const char*>(header), 8)
+   || !os.write(reinterpret_cast<const char*>(data), size)
+   || !os.write(reinterpret_cast<const char*>(footer), 4))
+    return -1;
+  return 0;
+}
+
+}
+
+// Encodes horizontal stripes of rows in parallel. Each stripe is filtered
+// and compressed into an independent raw deflate stream terminated with a
+// sync flush, so the stripes can be concatenated into one zlib stream.
+class PNGWriter::StripeEncoder {
+public:
+  StripeEncoder(std::ostream& os, const PNGOptions& options)
+    : os_(os)
+    , options_(options)
+    , width_(0)
+    , height_(0)
+    , bpp_(0)
+    , stripe_rows_(0)
+    , max_pending_(0)
+    , next_row_(0)
+    , adler_(adler32(0, Z_NULL, 0))
+  {}
+
+  ~StripeEncoder() {
+    // wait for in-flight jobs
+    for (auto& stripe : pending_) {
+      stripe->job.wait();
+    }
+  }
+
+  int begin(uint32_t width, uint32_t height, uint32_t bpp) {
+    if (0 == width || 0 == height)
+      return -1;
+
+    width_  = width;
+    height_ = height;
+    bpp_    = bpp;
+
+    uint32_t num_threads = options_.num_threads;
+    if (0 == num_threads) {
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // two stripes per thread, each holding 256KB to 4MB of pixels
+    uint32_t row_size = width * bpp;
+    uint32_t min_rows = std::max(1u, (256 * 1024) / row_size);
+    uint32_t max_rows = std::max(1u, (4 * 1024 * 1024) / row_size);
+    stripe_rows_ = (height + 2 * num_threads - 1) / (2 * num_threads);
+    stripe_rows_ = std::min(std::max(stripe_rows_, min_rows), max_rows);
+    max_pending_ = 2 * num_threads;
+
+    // write signature and header
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (!os_.write(reinterpret_cast<const char*>(signature), 8))
+      return -1;
+
+    uint8_t ihdr[13];
+    write_be32(ihdr + 0, width);
+    write_be32(ihdr + 4, height);
+    ihdr[8]  = 8; // bit depth
+    ihdr[9]  = (bpp == 1) ? PNG_COLOR_TYPE_GRAY :
+               (bpp == 3) ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+    ihdr[10] = PNG_COMPRESSION_TYPE_DEFAULT;
+    ihdr[11] = PNG_FILTER_TYPE_DEFAULT;
+    ihdr[12] = PNG_INTERLACE_NONE;
+    return write_chunk(os_, "IHDR", ihdr, sizeof(ihdr));
+  }
+
+  int writeRow(const uint8_t* row) {
+    uint32_t row_size = width_ * bpp_;
+    if (!current_) {
+      current_.reset(new stripe_t());
+      current_->first = (0 == next_row_);
+      current_->last  = (next_row_ + stripe_rows_ >= height_);
+      current_->prev  = last_row_;
+      current_->rows.reserve(stripe_rows_ * row_size);
+    }
+    current_->rows.insert(current_->rows.end(), row, row + row_size);
+    ++next_row_;
+
+    if (current_->rows.size() == stripe_rows_ * row_size
+     || next_row_ == height_) {
+      // keep the last row for the next stripe's filter
+      last_row_.assign(row, row + row_size);
+      return this->submit();
+    }
+    return 0;
+  }
+
+  int finish() {
+    int ret = this->flush(0);
+    if (ret)
+      return ret;
+    return write_chunk(os_, "IEND", nullptr, 0);
+  }
+
+private:
+
+  struct stripe_t {
+    std::vector<uint8_t> rows;
+    std::vector<uint8_t> prev;
+    std::vector<uint8_t> output;
+    uLong adler;
+    uLong length;
+    bool first;
+    bool last;
+    std::future<int> job;
+  };
+
+  int submit() {
+    auto stripe = current_.get();
+    stripe->job = std::async(std::launch::async, [this, stripe]()->int {
+      return this->encode(stripe);
+    });
+    pending_.push_back(std::move(current_));
+    return this->flush(max_pending_);
+  }
+
+  // write completed stripes in order until at most max_pending remain
+  int flush(size_t max_pending) {
+    while (pending_.size() > max_pending) {
+      std::unique_ptr<stripe_t> stripe(std::move(pending_.front()));
+      pending_.pop_front();
+      if (stripe->job.get())
+        return -1;
+      adler_ = adler32_combine(adler_, stripe->adler, stripe->length);
+      if (stripe->last) {
+        uint8_t trailer[4];
+        write_be32(trailer, adler_);
+        stripe->output.insert(stripe->output.end(), trailer, trailer + 4);
+      }
+      if (write_chunk(os_, "IDAT", stripe->output.data(), stripe->output.size()))
+        return -1;
+    }
+    return 0;
+  }
+
+  int encode(stripe_t* stripe) const {
+    uint32_t row_size = width_ * bpp_;
+    uint32_t count = stripe->rows.size() / row_size;
+
+    // allowed filters, libpng uses adaptive filtering by default
+    int filters = (options_.filters >= 0) ? options_.filters : PNGOptions::FILTER_ALL;
+    if (0 == (filters & PNGOptions::FILTER_ALL))
+      filters = PNGOptions::FILTER_NONE;
+
+    // swap BGR to RGB
+    std::vector<uint8_t> cur(row_size), prev(row_size, 0);
+    auto swap_row = [&](uint8_t* dst, const uint8_t* src) {
+      if (bpp_ >= 3) {
+        for (uint32_t i = 0; i < row_size; i += bpp_) {
+          dst[i + 0] = src[i + 2];
+          dst[i + 1] = src[i + 1];
+          dst[i + 2] = src[i + 0];
+          if (4 == bpp_)
+            dst[i + 3] = src[i + 3];
+        }
+      } else {
+        memcpy(dst, src, row_size);
+      }
+    };
+    if (!stripe->prev.empty()) {
+      swap_row(prev.data(), stripe->prev.data());
+    }
+
+    // filter rows
+    std::vector<uint8_t> filtered((row_size + 1) * count);
+    std::vector<uint8_t> trial(row_size + 1);
+    auto dst = filtered.data();
+    auto src = stripe->rows.data();
+    for (uint32_t y = 0; y < count; ++y) {
+      swap_row(cur.data(), src);
+      int best_type = -1;
+      uint32_t best_cost = 0;
+      for (int type = FILTER_TYPE_NONE; type <= FILTER_TYPE_PAETH; ++type) {
+        if (0 == (filters & (PNGOptions::FILTER_NONE << type)))
+          continue;
+        if (best_type < 0) {
+          filter_row(dst, type, cur.data(), prev.data(), row_size, bpp_);
+          best_type = type;
+          best_cost = filter_cost(dst + 1, row_size);
+        } else {
+          filter_row(trial.data(), type, cur.data(), prev.data(), row_size, bpp_);
+          uint32_t cost = filter_cost(trial.data() + 1, row_size);
+          if (cost < best_cost) {
+            memcpy(dst, trial.data(), row_size + 1);
+            best_type = type;
+            best_cost = cost;
+          }
+        }
+      }
+      cur.swap(prev);
+      dst += row_size + 1;
+      src += row_size;
+    }
+    stripe->rows.clear();
+    stripe->rows.shrink_to_fit();
+    stripe->adler  = adler32(adler32(0, Z_NULL, 0), filtered.data(), filtered.size());
+    stripe->length = filtered.size();
+
+    // compress into a raw deflate stream
+    int level = (options_.compression_level >= 0) ? options_.compression_level : Z_DEFAULT_COMPRESSION;
+    int strategy = (options_.strategy >= 0) ? options_.strategy : Z_DEFAULT_STRATEGY;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+      return -1;
+
+    uint32_t offset = 0;
+    stripe->output.resize(deflateBound(&zs, filtered.size()) + 16);
+    if (stripe->first) {
+      // zlib stream header
+      stripe->output[0] = 0x78;
+      stripe->output[1] = (level == 0 || level == 1) ? 0x01 :
+                          (level >= 2 && level <= 5) ? 0x5e :
+                          (level >= 7) ? 0xda : 0x9c;
+      offset = 2;
+    }
+
+    zs.next_in  = filtered.data();
+    zs.avail_in = filtered.size();
+    int flush = stripe->last ? Z_FINISH : Z_SYNC_FLUSH;
+    for (;;) {
+      zs.next_out  = stripe->output.data() + offset;
+      zs.avail_out = stripe->output.size() - offset;
+      int ret = deflate(&zs, flush);
+      offset = stripe->output.size() - zs.avail_out;
+      if (ret == Z_STREAM_END
+       || (ret == Z_OK && flush == Z_SYNC_FLUSH && zs.avail_out != 0))
+        break;
+      if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        deflateEnd(&zs);
+        return -1;
+      }
+      stripe->output.resize(stripe->output.size() * 2);
+    }
+    deflateEnd(&zs);
+    stripe->output.resize(offset);
+
+    return 0;
+  }
+
+  std::ostream& os_;
+  PNGOptions options_;
+  uint32_t width_;
+  uint32_t height_;
+  uint32_t bpp_;
+  uint32_t stripe_rows_;
+  uint32_t max_pending_;
+  uint32_t next_row_;
+  uLong adler_;
+  std::vector<uint8_t> last_row_;
+  std::unique_ptr<stripe_t> current_;
+  std::deque<std::unique_ptr<stripe_t>> pending_;
+};
+
+PNGWriter::PNGWriter(const char *filename, const PNGOptions& options)
+  : filename_(filename)
+  , options_(options)
+  , os_(nullptr)
+  , png_(nullptr)
+  , png_info_(nullptr)
+  , height_(0)
+  , next_row_(0)
+{}
+
+PNGWriter::PNGWriter(std::ostream &os, const PNGOptions& options)
+  : options_(options)
+  , os_(&os)
+  , png_(nullptr)
+  , png_info_(nullptr)
+  , height_(0)
+  , next_row_(0)
+{}
+
+PNGWriter::~PNGWriter() {
+  this->close();
+}
+
+void PNGWriter::close() {
+  stripes_.reset();
+  if (png_) {
+    png_destroy_write_struct(&png_, &png_info_);
+    png_ = nullptr;
+    png_info_ = nullptr;
+  }
+  if (ofs_.is_open()) {
+    ofs_.close();
+  }
+}
+
+int PNGWriter::begin(uint32_t width,
+                     uint32_t height, 
+                     ePixelFormat format) {
+  uint32_t bpp = Format::GetInfo(format).BytePerPixel;
+  if (bpp != 1 && bpp != 3 && bpp != 4) {
+    std::cerr << "unsupported pixel stride: " << bpp << "!" << std::endl;
     return -1;
   }
 
-  auto png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+  if (nullptr == os_) {
+    ofs_.open(filename_.c_str(), std::ios::out | std::ios::binary);
+    if (!ofs_.is_open()) {
+      std::cerr << "couldn't create file: " << filename_ << "!" << std::endl;
+      return -1;
+    }
+    os_ = &ofs_;
+  }
+
+  height_   = height;
+  next_row_ = 0;
+
+  if (options_.num_threads != 1) {
+    stripes_.reset(new StripeEncoder(*os_, options_));
+    int ret = stripes_->begin(width, height, bpp);
+    if (ret)
+      this->close();
+    return ret;
+  }
+
+  png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
       (png_error_ptr)pngfile_error, (png_error_ptr)NULL);
-	if (!png) {
-    fclose(file);
+	if (!png_) {
+    this->close();
 		return -1;
 	}
 
-  auto png_info = png_create_info_struct(png);
-  if (!png_info) {
-    fclose(file);
+  png_info_ = png_create_info_struct(png_);
+  if (!png_info_) {
+    this->close();
 		return -1;
   }
 
-	png_init_io(png, file);
+  // libpng errors return here
+  if (setjmp(png_jmpbuf(png_))) {
+    this->close();
+    return -1;
+  }
+
+	png_set_write_fn(png_, os_, pngstream_write, pngstream_flush);
 
 	int depth = 8;
 	int colortype = (bpp == 1) ? PNG_COLOR_TYPE_GRAY :
 		              (bpp == 3) ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
 
-	png_set_IHDR(png, png_info, width, height, depth, colortype,
+	png_set_IHDR(png_, png_info_, width, height, depth, colortype,
 		PNG_INTERLACE_NONE, 
 		PNG_COMPRESSION_TYPE_DEFAULT, 
 		PNG_FILTER_TYPE_DEFAULT);
 
+  // apply encoder tuning
+  if (options_.compression_level >= 0)
+    png_set_compression_level(png_, options_.compression_level);
+  if (options_.filters >= 0)
+    png_set_filter(png_, PNG_FILTER_TYPE_BASE, options_.filters);
+  if (options_.strategy >= 0)
+    png_set_compression_strategy(png_, options_.strategy);
+  if (options_.buffer_size > 0)
+    png_set_compression_buffer_size(png_, options_.buffer_size);
+
 	// write the file header information
-	png_write_info(png, png_info);
+	png_write_info(png_, png_info_);
 
 	// swap the BGR pixels in the DiData structure to RGB
-	png_set_bgr(png);
+	png_set_bgr(png_);
+
+  return 0;
+}
+
+int PNGWriter::writeRows(const uint8_t* rows, 
+                         uint32_t y, 
+                         uint32_t count, 
+                         int32_t pitch) {
+  if ((nullptr == png_ && !stripes_) || y != next_row_ || y + count > height_) {
+    std::cerr << "out of order PNG rows!" << std::endl;
+    return -1;
+  }
+
+  if (stripes_) {
+    for (uint32_t i = 0; i < count; ++i) {
+      int ret = stripes_->writeRow(rows);
+      if (ret)
+        return ret;
+      rows += pitch;
+    }
+    next_row_ += count;
+    return 0;
+  }
+
+  const uint8_t* volatile src_rows = rows;
+
+  if (setjmp(png_jmpbuf(png_))) {
+    this->close();
+    return -1;
+  }
 
   // write pixels
-  auto src_rows = pixels;
-	for (uint32_t y = 0; y < height; ++y) {
-    png_write_row(png, (uint8_t*)src_rows);
+	for (uint32_t i = 0; i < count; ++i) {
+    png_write_row(png_, (uint8_t*)src_rows);
     src_rows += pitch;
   }	
-	png_write_end(png, png_info);
+  next_row_ += count;
 
-	png_destroy_write_struct(&png, (png_infopp) NULL);
+  return 0;
+}
 
-  fclose(file);
+int PNGWriter::finish() {
+  if ((nullptr == png_ && !stripes_) || next_row_ != height_) {
+    std::cerr << "incomplete PNG image!" << std::endl;
+    return -1;
+  }
 
-  return 0;
-}
\ No newline at end of file
+  if (stripes_) {
+    int ret = stripes_->finish();
+    this->close();
+    if (os_ != &ofs_)
+      os_->flush();
+    return (ret || os_->fail()) ? -1 : 0;
+  }
+
+  if (setjmp(png_jmpbuf(png_))) {
+    this->close();
+    return -1;
+  }
+
+	png_write_end(png_, png_info_);
+
+  this->close();
+
+  if (os_ != &ofs_)
+    os_->flush();
+
+  return os_->fail() ? -1 : 0;
+}
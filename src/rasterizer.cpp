@@ -0,0 +1,1000 @@
+#include "rasterizer.hpp"
+#include "blitter.hpp"
+#include "color.hpp"
+#include "format.hpp"
+#include "math.hpp"
+#include "workerpool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+using namespace cocogfx;
+
+namespace {
+
+enum {
+  SUBPIXEL_BITS = 4,
+  SUBPIXEL_ONE  = 1 << SUBPIXEL_BITS,
+  SUBPIXEL_HALF = SUBPIXEL_ONE / 2,
+  NUM_ATTRIBS   = 6, // r, g, b, a, u, v
+  MAX_CLIP_VERTICES = 3 + 6,
+};
+
+enum {
+  VERTEX_CHUNK     = 4096, // vertices per transform task
+  PRIMITIVE_CHUNK  = 1024, // primitives per setup and binning task
+  BATCH_DRAWCALLS  = 256,  // drawcalls binned together by replay()
+  BATCH_PRIMITIVES = 256 * 1024,
+};
+
+// clip-space position followed by the attributes
+struct clip_vertex_t {
+  float v[4 + NUM_ATTRIBS];
+};
+
+// vertex snapped to the 28.4 screen grid
+struct screen_vertex_t {
+  int32_t x;
+  int32_t y;
+  float z;
+  float rhw;
+  float attribs[NUM_ATTRIBS];
+};
+
+// triangle ready for scan conversion, counter-clockwise on screen
+struct triangle_t {
+  screen_vertex_t v[3];
+  int64_t area;        // twice the area in 28.4 units
+  float inv_area;
+  TRect<int32_t> bbox; // covered pixels, right/bottom exclusive
+  bool minify;         // texture minification
+};
+
+struct pipeline_t {
+  const CGLTrace::states_t* states;
+
+  uint8_t* color;
+  int32_t color_pitch;
+  uint32_t color_bpp;
+  Format::pfn_convert_to color_to;
+  Format::pfn_convert_from color_from;
+  bool color_read; // blending or partial write mask
+
+  uint8_t* depth; // null without depth buffer
+  int32_t depth_pitch;
+  uint32_t depth_bpp;
+  bool stencil;
+
+  const uint8_t* texels; // null without texturing
+  int32_t texture_pitch;
+  uint32_t texture_bpp;
+  uint32_t texture_width;
+  uint32_t texture_height;
+  Format::pfn_convert_from texture_from;
+  ColorARGB env_color;
+};
+
+bool is_color_format(ePixelFormat format) {
+  return format > FORMAT_UNKNOWN && format < FORMAT_COLOR_SIZE_;
+}
+
+bool is_depth_format(ePixelFormat format) {
+  return format == FORMAT_D16 || format == FORMAT_X8S8D16;
+}
+
+int32_t to_unorm8(float value) {
+  return static_cast<int32_t>(Sat(value) * 255.0f + 0.5f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// planes -w <= x,y,z <= w, NaN coordinates are outside
+uint32_t outcode(const clip_vertex_t& cv) {
+  auto x = cv.v[0];
+  auto y = cv.v[1];
+  auto z = cv.v[2];
+  auto w = cv.v[3];
+  uint32_t code = 0;
+  if (!(w + x >= 0)) code |= 0x01;
+  if (!(w - x >= 0)) code |= 0x02;
+  if (!(w + y >= 0)) code |= 0x04;
+  if (!(w - y >= 0)) code |= 0x08;
+  if (!(w + z >= 0)) code |= 0x10;
+  if (!(w - z >= 0)) code |= 0x20;
+  return code;
+}
+
+float plane_distance(const clip_vertex_t& cv, uint32_t plane) {
+  auto c = cv.v[plane >> 1];
+  return (plane & 1) ? (cv.v[3] - c) : (cv.v[3] + c);
+}
+
+// Sutherland-Hodgman against the planes in mask, returns the vertex count.
+// Intersections are computed from the inside vertex so both triangles
+// sharing a clipped edge get the same point.
+uint32_t clip_triangle(const clip_vertex_t& v0,
+                       const clip_vertex_t& v1,
+                       const clip_vertex_t& v2,
+                       uint32_t mask,
+                       clip_vertex_t* out) {
+  clip_vertex_t buffers[2][MAX_CLIP_VERTICES];
+  auto src = buffers[0];
+  auto dst = buffers[1];
+  src[0] = v0;
+  src[1] = v1;
+  src[2] = v2;
+  uint32_t count = 3;
+
+  for (uint32_t plane = 0; plane < 6; ++plane) {
+    if (0 == (mask & (1 << plane)))
+      continue;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      auto& a = src[i];
+      auto& b = src[(i + 1) % count];
+      auto da = plane_distance(a, plane);
+      auto db = plane_distance(b, plane);
+      bool a_in = (da >= 0);
+      bool b_in = (db >= 0);
+      if (a_in) {
+        dst[n++] = a;
+      }
+      if (a_in != b_in) {
+        auto& in  = a_in ? a : b;
+        auto& out = a_in ? b : a;
+        auto din  = a_in ? da : db;
+        auto dout = a_in ? db : da;
+        auto t = din / (din - dout);
+        for (uint32_t k = 0; k < 4 + NUM_ATTRIBS; ++k) {
+          dst[n].v[k] = in.v[k] + t * (out.v[k] - in.v[k]);
+        }
+        ++n;
+      }
+    }
+    std::swap(src, dst);
+    count = n;
+    if (count < 3)
+      return 0;
+  }
+
+  std::copy(src, src + count, out);
+  return count;
+}
+
+bool to_screen(const clip_vertex_t& cv,
+               const CGLTrace::viewport_t& viewport,
+               screen_vertex_t* sv) {
+  TVector4<float> pos;
+  ClipToScreen<float>(&pos,
+                      TVector4<float>(cv.v[0], cv.v[1], cv.v[2], cv.v[3]),
+                      viewport.left,
+                      viewport.right,
+                      viewport.top,
+                      viewport.bottom,
+                      viewport.near,
+                      viewport.far);
+  // clipped vertices stay within the viewport, this only rejects garbage
+  const float limit = float(1 << 24);
+  if (!(std::abs(pos.x) < limit && std::abs(pos.y) < limit && std::isfinite(pos.w)))
+    return false;
+  sv->x   = static_cast<int32_t>(std::floor(pos.x * SUBPIXEL_ONE + 0.5f));
+  sv->y   = static_cast<int32_t>(std::floor(pos.y * SUBPIXEL_ONE + 0.5f));
+  sv->z   = Sat(pos.z);
+  sv->rhw = pos.w;
+  for (uint32_t k = 0; k < NUM_ATTRIBS; ++k) {
+    sv->attribs[k] = cv.v[4 + k];
+  }
+  return true;
+}
+
+void load_vertex(const CGLTrace::vertex_t& vertex, clip_vertex_t* cv) {
+  cv->v[0] = vertex.pos.x;
+  cv->v[1] = vertex.pos.y;
+  cv->v[2] = vertex.pos.z;
+  cv->v[3] = vertex.pos.w;
+  cv->v[4] = vertex.color.r;
+  cv->v[5] = vertex.color.g;
+  cv->v[6] = vertex.color.b;
+  cv->v[7] = vertex.color.a;
+  cv->v[8] = vertex.texcoord.u;
+  cv->v[9] = vertex.texcoord.v;
+}
+
+int64_t edge_function(int32_t ax, int32_t ay, int32_t bx, int32_t by, int32_t px, int32_t py) {
+  return int64_t(bx - ax) * (py - ay) - int64_t(by - ay) * (px - ax);
+}
+
+bool setup_triangle(const screen_vertex_t& v0,
+                    const screen_vertex_t& v1,
+                    const screen_vertex_t& v2,
+                    const TRect<int32_t>& scissor,
+                    const pipeline_t& pipe,
+                    triangle_t* tri) {
+  auto area = edge_function(v0.x, v0.y, v1.x, v1.y, v2.x, v2.y);
+  if (0 == area)
+    return false;
+
+  // both faces are drawn, keep a positive winding
+  tri->v[0] = v0;
+  if (area > 0) {
+    tri->v[1] = v1;
+    tri->v[2] = v2;
+  } else {
+    tri->v[1] = v2;
+    tri->v[2] = v1;
+    area = -area;
+  }
+  tri->area = area;
+  tri->inv_area = 1.0f / static_cast<float>(area);
+
+  // pixels whose center lies within the bounds
+  TRect<int32_t> bounds;
+  CalcBoundingBox<int32_t>(&bounds,
+                           TVector2<int32_t>(v0.x, v0.y),
+                           TVector2<int32_t>(v1.x, v1.y),
+                           TVector2<int32_t>(v2.x, v2.y));
+  tri->bbox.left   = std::max(scissor.left,   -((SUBPIXEL_HALF - bounds.left) >> SUBPIXEL_BITS));
+  tri->bbox.top    = std::max(scissor.top,    -((SUBPIXEL_HALF - bounds.top) >> SUBPIXEL_BITS));
+  tri->bbox.right  = std::min(scissor.right,  ((bounds.right - SUBPIXEL_HALF) >> SUBPIXEL_BITS) + 1);
+  tri->bbox.bottom = std::min(scissor.bottom, ((bounds.bottom - SUBPIXEL_HALF) >> SUBPIXEL_BITS) + 1);
+  if (tri->bbox.left >= tri->bbox.right || tri->bbox.top >= tri->bbox.bottom)
+    return false;
+
+  // one filter per triangle, from the texel to pixel area ratio
+  tri->minify = false;
+  if (pipe.texels) {
+    auto du1 = (v1.attribs[4] - v0.attribs[4]) * pipe.texture_width;
+    auto dv1 = (v1.attribs[5] - v0.attribs[5]) * pipe.texture_height;
+    auto du2 = (v2.attribs[4] - v0.attribs[4]) * pipe.texture_width;
+    auto dv2 = (v2.attribs[5] - v0.attribs[5]) * pipe.texture_height;
+    auto texel_area = std::abs(du1 * dv2 - du2 * dv1);
+    auto pixel_area = static_cast<float>(area) / (SUBPIXEL_ONE * SUBPIXEL_ONE);
+    tri->minify = texel_area > pixel_area;
+  }
+
+  return true;
+}
+
+// transformed drawcall vertices
+struct vertex_buffer_t {
+  std::vector<clip_vertex_t> clip;
+  std::vector<screen_vertex_t> screen;
+  std::vector<uint32_t> codes;
+};
+
+int check_primitives(const CGLTrace::drawcall_t& drawcall) {
+  auto num_vertices = drawcall.vertices.size();
+  for (auto& primitive : drawcall.primitives) {
+    if (primitive.i0 >= num_vertices
+     || primitive.i1 >= num_vertices
+     || primitive.i2 >= num_vertices) {
+      std::cerr << "invalid vertex index!" << std::endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// the buffer must be sized to the drawcall vertices
+void transform_vertices(const CGLTrace::drawcall_t& drawcall,
+                        size_t begin,
+                        size_t end,
+                        vertex_buffer_t* buffer) {
+  for (size_t i = begin; i < end; ++i) {
+    auto& cv = buffer->clip[i];
+    load_vertex(drawcall.vertices[i], &cv);
+    auto code = outcode(cv);
+    if (0 == code && !to_screen(cv, drawcall.viewport, &buffer->screen[i])) {
+      code = 0x3f;
+    }
+    buffer->codes[i] = code;
+  }
+}
+
+// append the triangles of primitives [begin, end) in order
+void setup_primitives(const CGLTrace::drawcall_t& drawcall,
+                      size_t begin,
+                      size_t end,
+                      const vertex_buffer_t& buffer,
+                      const TRect<int32_t>& scissor,
+                      const pipeline_t& pipe,
+                      std::vector<triangle_t>* triangles) {
+  for (size_t p = begin; p < end; ++p) {
+    auto& primitive = drawcall.primitives[p];
+    auto c0 = buffer.codes[primitive.i0];
+    auto c1 = buffer.codes[primitive.i1];
+    auto c2 = buffer.codes[primitive.i2];
+    if (c0 & c1 & c2)
+      continue;
+
+    triangle_t tri;
+    if (0 == (c0 | c1 | c2)) {
+      if (setup_triangle(buffer.screen[primitive.i0],
+                         buffer.screen[primitive.i1],
+                         buffer.screen[primitive.i2],
+                         scissor, pipe, &tri)) {
+        triangles->push_back(tri);
+      }
+      continue;
+    }
+
+    clip_vertex_t polygon[MAX_CLIP_VERTICES];
+    auto count = clip_triangle(buffer.clip[primitive.i0],
+                               buffer.clip[primitive.i1],
+                               buffer.clip[primitive.i2],
+                               c0 | c1 | c2,
+                               polygon);
+    screen_vertex_t fan[MAX_CLIP_VERTICES];
+    bool valid = true;
+    for (uint32_t i = 0; i < count && valid; ++i) {
+      valid = to_screen(polygon[i], drawcall.viewport, &fan[i]);
+    }
+    if (!valid)
+      continue;
+    for (uint32_t i = 2; i < count; ++i) {
+      if (setup_triangle(fan[0], fan[i - 1], fan[i], scissor, pipe, &tri)) {
+        triangles->push_back(tri);
+      }
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool compare(CGLTrace::ecompare func, uint32_t value, uint32_t stored) {
+  switch (func) {
+  case CGLTrace::COMPARE_NEVER:    return false;
+  case CGLTrace::COMPARE_LESS:     return value <  stored;
+  case CGLTrace::COMPARE_EQUAL:    return value == stored;
+  case CGLTrace::COMPARE_LEQUAL:   return value <= stored;
+  case CGLTrace::COMPARE_GREATER:  return value >  stored;
+  case CGLTrace::COMPARE_NOTEQUAL: return value != stored;
+  case CGLTrace::COMPARE_GEQUAL:   return value >= stored;
+  default:                         return true;
+  }
+}
+
+uint32_t stencil_op(CGLTrace::eStencilOp op, uint32_t value, uint32_t ref) {
+  switch (op) {
+  case CGLTrace::STENCIL_REPLACE: return ref;
+  case CGLTrace::STENCIL_INCR:    return std::min<uint32_t>(value + 1, 0xff);
+  case CGLTrace::STENCIL_DECR:    return value ? value - 1 : 0;
+  case CGLTrace::STENCIL_ZERO:    return 0;
+  case CGLTrace::STENCIL_INVERT:  return ~value & 0xff;
+  default:                        return value;
+  }
+}
+
+int32_t blend_factor(CGLTrace::eBlendOp op,
+                     const ColorARGB& src,
+                     const ColorARGB& dst,
+                     uint32_t channel) {
+  bool alpha = (channel == 3);
+  switch (op) {
+  case CGLTrace::BLEND_ZERO:                return 0;
+  case CGLTrace::BLEND_ONE:                 return 0xff;
+  case CGLTrace::BLEND_SRC_COLOR:           return src.m[channel];
+  case CGLTrace::BLEND_ONE_MINUS_SRC_COLOR: return 0xff - src.m[channel];
+  case CGLTrace::BLEND_SRC_ALPHA:           return src.a;
+  case CGLTrace::BLEND_ONE_MINUS_SRC_ALPHA: return 0xff - src.a;
+  case CGLTrace::BLEND_DST_ALPHA:           return dst.a;
+  case CGLTrace::BLEND_ONE_MINUS_DST_ALPHA: return 0xff - dst.a;
+  case CGLTrace::BLEND_DST_COLOR:           return dst.m[channel];
+  case CGLTrace::BLEND_ONE_MINUS_DST_COLOR: return 0xff - dst.m[channel];
+  case CGLTrace::BLEND_SRC_ALPHA_SATURATE:  return alpha ? 0xff : std::min<int32_t>(src.a, 0xff - dst.a);
+  default:                                  return 0;
+  }
+}
+
+int32_t address(int32_t coord, uint32_t size, CGLTrace::eTexAddress mode) {
+  if (mode == CGLTrace::ADDRESS_CLAMP)
+    return std::min<int32_t>(std::max<int32_t>(coord, 0), size - 1);
+  auto wrapped = coord % int32_t(size);
+  return (wrapped < 0) ? wrapped + size : wrapped;
+}
+
+ColorARGB fetch(const pipeline_t& pipe, int32_t x, int32_t y) {
+  return pipe.texture_from(pipe.texels + y * pipe.texture_pitch + x * pipe.texture_bpp);
+}
+
+// texture coordinates with 8 fractional bits
+int64_t to_texel(float coord, uint32_t size) {
+  // saturate far coordinates so clamp mode still picks the edge texel,
+  // wrap mode stays defined; float texels are too coarse there anyway
+  const float limit = 65536.0f;
+  auto value = coord * size;
+  if (value != value)
+    return 0;
+  value = std::min(std::max(value, -limit), limit);
+  return static_cast<int64_t>(std::floor(value * 256.0f));
+}
+
+ColorARGB sample(const pipeline_t& pipe, float u, float v, bool linear) {
+  auto& states = *pipe.states;
+  auto su = to_texel(u, pipe.texture_width);
+  auto sv = to_texel(v, pipe.texture_height);
+  if (!linear) {
+    auto x = address(int32_t(su >> 8), pipe.texture_width, states.texture_addressU);
+    auto y = address(int32_t(sv >> 8), pipe.texture_height, states.texture_addressV);
+    return fetch(pipe, x, y);
+  }
+
+  su -= 0x80;
+  sv -= 0x80;
+  auto fx = int32_t(su & 0xff);
+  auto fy = int32_t(sv & 0xff);
+  auto x0 = address(int32_t(su >> 8), pipe.texture_width, states.texture_addressU);
+  auto x1 = address(int32_t(su >> 8) + 1, pipe.texture_width, states.texture_addressU);
+  auto y0 = address(int32_t(sv >> 8), pipe.texture_height, states.texture_addressV);
+  auto y1 = address(int32_t(sv >> 8) + 1, pipe.texture_height, states.texture_addressV);
+  auto c00 = fetch(pipe, x0, y0);
+  auto c10 = fetch(pipe, x1, y0);
+  auto c01 = fetch(pipe, x0, y1);
+  auto c11 = fetch(pipe, x1, y1);
+  ColorARGB ret;
+  for (uint32_t i = 0; i < 4; ++i) {
+    auto top = Lerp8(c00.m[i], c10.m[i], fx);
+    auto bottom = Lerp8(c01.m[i], c11.m[i], fx);
+    ret.m[i] = static_cast<uint8_t>(Lerp8(top, bottom, fy));
+  }
+  return ret;
+}
+
+bool is_linear(CGLTrace::eTexFilter filter) {
+  return filter == CGLTrace::FILTER_LINEAR
+      || filter == CGLTrace::FILTER_LINEAR_MIPMAP_NEAREST
+      || filter == CGLTrace::FILTER_LINEAR_MIPMAP_LINEAR;
+}
+
+// fixed-function texture environment
+ColorARGB combine(CGLTrace::eEnvMode mode,
+                  const ColorARGB& cf,
+                  const ColorARGB& ct,
+                  const ColorARGB& cc) {
+  ColorARGB ret;
+  switch (mode) {
+  case CGLTrace::ENVMODE_REPLACE:
+    ret = ct;
+    break;
+  case CGLTrace::ENVMODE_MODULATE:
+    for (uint32_t i = 0; i < 4; ++i) {
+      ret.m[i] = static_cast<uint8_t>(Mul8(cf.m[i], ct.m[i]));
+    }
+    break;
+  case CGLTrace::ENVMODE_DECAL:
+    for (uint32_t i = 0; i < 3; ++i) {
+      ret.m[i] = static_cast<uint8_t>(Lerp8(cf.m[i], ct.m[i], ct.a));
+    }
+    ret.a = cf.a;
+    break;
+  case CGLTrace::ENVMODE_BLEND:
+    for (uint32_t i = 0; i < 3; ++i) {
+      ret.m[i] = static_cast<uint8_t>(Lerp8(cf.m[i], cc.m[i], ct.m[i]));
+    }
+    ret.a = static_cast<uint8_t>(Mul8(cf.a, ct.a));
+    break;
+  case CGLTrace::ENVMODE_ADD:
+    for (uint32_t i = 0; i < 3; ++i) {
+      ret.m[i] = static_cast<uint8_t>(Add8(cf.m[i], ct.m[i]));
+    }
+    ret.a = static_cast<uint8_t>(Mul8(cf.a, ct.a));
+    break;
+  default:
+    ret = cf;
+    break;
+  }
+  return ret;
+}
+
+// depth and stencil tests, returns false if the fragment is discarded
+bool depth_stencil(const pipeline_t& pipe, int32_t x, int32_t y, uint32_t depth) {
+  auto& states = *pipe.states;
+  auto p = pipe.depth + y * pipe.depth_pitch + x * pipe.depth_bpp;
+  uint32_t value = 0;
+  memcpy(&value, p, pipe.depth_bpp);
+  uint32_t stored_depth = value & 0xffff;
+  uint32_t stencil = (value >> 16) & 0xff;
+
+  bool stencil_test = pipe.stencil && states.stencil_test;
+  uint32_t ref = states.stencil_ref;
+  uint32_t new_stencil = stencil;
+  bool pass = true;
+  if (stencil_test && !compare(states.stencil_func,
+                               ref & states.stencil_mask,
+                               stencil & states.stencil_mask)) {
+    new_stencil = stencil_op(states.stencil_fail, stencil, ref);
+    pass = false;
+  } else if (states.depth_test && !compare(states.depth_func, depth, stored_depth)) {
+    if (stencil_test) {
+      new_stencil = stencil_op(states.stencil_zfail, stencil, ref);
+    }
+    pass = false;
+  } else {
+    if (stencil_test) {
+      new_stencil = stencil_op(states.stencil_zpass, stencil, ref);
+    }
+    if (states.depth_test && states.depth_writemask) {
+      stored_depth = depth;
+    }
+  }
+
+  uint32_t writemask = states.stencil_writemask;
+  new_stencil = (stencil & ~writemask) | (new_stencil & writemask);
+  uint32_t new_value = (value & 0xff000000) | (new_stencil << 16) | stored_depth;
+  if (new_value != value) {
+    memcpy(p, &new_value, pipe.depth_bpp);
+  }
+  return pass;
+}
+
+void shade_fragment(const pipeline_t& pipe,
+                    const triangle_t& tri,
+                    int32_t x,
+                    int32_t y,
+                    const int64_t* e) {
+  auto& states = *pipe.states;
+  auto& v = tri.v;
+  float b0 = static_cast<float>(e[0]) * tri.inv_area;
+  float b1 = static_cast<float>(e[1]) * tri.inv_area;
+  float b2 = static_cast<float>(e[2]) * tri.inv_area;
+
+  if (pipe.depth) {
+    auto z = Sat(b0 * v[0].z + b1 * v[1].z + b2 * v[2].z);
+    auto depth = static_cast<uint32_t>(z * 0xffff + 0.5f);
+    if (!depth_stencil(pipe, x, y, depth))
+      return;
+  }
+
+  if (!pipe.color)
+    return;
+
+  // perspective-correct attributes
+  float q0 = b0 * v[0].rhw;
+  float q1 = b1 * v[1].rhw;
+  float q2 = b2 * v[2].rhw;
+  float q = q0 + q1 + q2;
+  float rq = (q != 0) ? 1.0f / q : 0.0f;
+  float attribs[NUM_ATTRIBS];
+  for (uint32_t k = 0; k < NUM_ATTRIBS; ++k) {
+    attribs[k] = (q0 * v[0].attribs[k] + q1 * v[1].attribs[k] + q2 * v[2].attribs[k]) * rq;
+  }
+
+  ColorARGB color(to_unorm8(attribs[3]),
+                  to_unorm8(attribs[0]),
+                  to_unorm8(attribs[1]),
+                  to_unorm8(attribs[2]));
+
+  if (pipe.texels) {
+    auto filter = tri.minify ? states.texture_minfilter : states.texture_magfilter;
+    auto texel = sample(pipe, attribs[4], attribs[5], is_linear(filter));
+    color = combine(states.texture_envmode, color, texel, pipe.env_color);
+  }
+
+  auto p = pipe.color + y * pipe.color_pitch + x * pipe.color_bpp;
+  if (pipe.color_read) {
+    auto dst = pipe.color_from(p);
+    if (states.blend_enabled) {
+      ColorARGB blended;
+      for (uint32_t i = 0; i < 4; ++i) {
+        // m[] is b, g, r, a
+        auto sf = blend_factor(states.blend_src, color, dst, i);
+        auto df = blend_factor(states.blend_dst, color, dst, i);
+        blended.m[i] = static_cast<uint8_t>(Add8(Mul8(color.m[i], sf), Mul8(dst.m[i], df)));
+      }
+      color = blended;
+    }
+    auto mask = states.color_writemask;
+    if (0 == (mask & 0x1)) color.r = dst.r;
+    if (0 == (mask & 0x2)) color.g = dst.g;
+    if (0 == (mask & 0x4)) color.b = dst.b;
+    if (0 == (mask & 0x8)) color.a = dst.a;
+  }
+  pipe.color_to(p, color);
+}
+
+void raster_triangle(const pipeline_t& pipe,
+                     const triangle_t& tri,
+                     const TRect<int32_t>& rect) {
+  auto left   = std::max(tri.bbox.left, rect.left);
+  auto top    = std::max(tri.bbox.top, rect.top);
+  auto right  = std::min(tri.bbox.right, rect.right);
+  auto bottom = std::min(tri.bbox.bottom, rect.bottom);
+  if (left >= right || top >= bottom)
+    return;
+
+  // edge i is opposite vertex i, its value is the weight of that vertex
+  int64_t row[3], step_x[3], step_y[3], bias[3];
+  int32_t px = left * SUBPIXEL_ONE + SUBPIXEL_HALF;
+  int32_t py = top * SUBPIXEL_ONE + SUBPIXEL_HALF;
+  for (uint32_t i = 0; i < 3; ++i) {
+    auto& a = tri.v[(i + 1) % 3];
+    auto& b = tri.v[(i + 2) % 3];
+    int32_t dx = b.x - a.x;
+    int32_t dy = b.y - a.y;
+    row[i]    = edge_function(a.x, a.y, b.x, b.y, px, py);
+    step_x[i] = -int64_t(dy) * SUBPIXEL_ONE;
+    step_y[i] = int64_t(dx) * SUBPIXEL_ONE;
+    // top-left fill rule, pixels on other edges are left out
+    bool top_left = (dy < 0) || (dy == 0 && dx > 0);
+    bias[i] = top_left ? 0 : -1;
+  }
+
+  for (int32_t y = top; y < bottom; ++y) {
+    int64_t e[3] = {row[0], row[1], row[2]};
+    for (int32_t x = left; x < right; ++x) {
+      if ((e[0] + bias[0]) >= 0 && (e[1] + bias[1]) >= 0 && (e[2] + bias[2]) >= 0) {
+        shade_fragment(pipe, tri, x, y, e);
+      }
+      e[0] += step_x[0];
+      e[1] += step_x[1];
+      e[2] += step_x[2];
+    }
+    row[0] += step_y[0];
+    row[1] += step_y[1];
+    row[2] += step_y[2];
+  }
+}
+
+int init_pipeline(const CGLTrace::drawcall_t& drawcall,
+                  const CGLTrace::texture_t* texture,
+                  CGLRasterizer::surface_t& color,
+                  CGLRasterizer::surface_t& depth,
+                  pipeline_t* pipe) {
+  auto& states = drawcall.states;
+  pipe->states = &states;
+
+  pipe->color = nullptr;
+  if (states.color_enabled && !color.pixels.empty()) {
+    pipe->color       = color.pixels.data();
+    pipe->color_pitch = color.pitch;
+    pipe->color_bpp   = Format::GetInfo(color.format).BytePerPixel;
+    pipe->color_to    = Format::GetConvertTo(color.format);
+    pipe->color_from  = Format::GetConvertFrom(color.format, true);
+    pipe->color_read  = states.blend_enabled || (states.color_writemask & 0xf) != 0xf;
+  }
+
+  pipe->depth = nullptr;
+  pipe->stencil = false;
+  if (is_depth_format(states.depth_format) && !depth.pixels.empty()) {
+    pipe->depth       = depth.pixels.data();
+    pipe->depth_pitch = depth.pitch;
+    pipe->depth_bpp   = Format::GetInfo(depth.format).BytePerPixel;
+    pipe->stencil     = (depth.format == FORMAT_X8S8D16);
+  }
+
+  pipe->texels = nullptr;
+  if (states.texture_enabled && texture) {
+    if (!is_color_format(texture->format)) {
+      std::cerr << "unsupported texture format: " << texture->format << "!" << std::endl;
+      return -1;
+    }
+    uint32_t bpp = Format::GetInfo(texture->format).BytePerPixel;
+    if (texture->width && texture->height
+     && texture->pixels.size() >= size_t(texture->width) * texture->height * bpp) {
+      pipe->texels         = texture->pixels.data();
+      pipe->texture_pitch  = texture->width * bpp;
+      pipe->texture_bpp    = bpp;
+      pipe->texture_width  = texture->width;
+      pipe->texture_height = texture->height;
+      pipe->texture_from   = Format::GetConvertFrom(texture->format, true);
+    }
+  }
+
+  auto& envcolor = states.texture_envcolor;
+  pipe->env_color = ColorARGB(to_unorm8(envcolor.a),
+                              to_unorm8(envcolor.r),
+                              to_unorm8(envcolor.g),
+                              to_unorm8(envcolor.b));
+  return 0;
+}
+
+// viewport bounds within the render target
+TRect<int32_t> get_scissor(const CGLTrace::viewport_t& viewport,
+                           const CGLRasterizer::surface_t& surface) {
+  TRect<int32_t> rect;
+  rect.left   = std::max(std::min(viewport.left, viewport.right), 0);
+  rect.top    = std::max(std::min(viewport.top, viewport.bottom), 0);
+  rect.right  = std::min<int32_t>(std::max(viewport.left, viewport.right), surface.width);
+  rect.bottom = std::min<int32_t>(std::max(viewport.top, viewport.bottom), surface.height);
+  return rect;
+}
+
+// batched drawcall on the tiled path
+struct tiled_draw_t {
+  pipeline_t pipe;
+  TRect<int32_t> scissor;
+  vertex_buffer_t vertices;
+};
+
+// triangles of a primitive range with their tile bins
+struct bin_chunk_t {
+  uint32_t draw; // batch entry
+  size_t begin;
+  size_t end;
+  std::vector<triangle_t> triangles;
+  std::vector<uint32_t> offsets; // per tile into entries, tile count + 1
+  std::vector<uint32_t> entries; // triangle indices grouped by tile
+};
+
+// counting sort of the triangles by tile, preserving their order
+void bin_triangles(bin_chunk_t* chunk, uint32_t tiles_x, uint32_t tiles_y) {
+  const int32_t TILE_SIZE = CGLRasterizer::TILE_SIZE;
+  auto num_tiles = tiles_x * tiles_y;
+  chunk->offsets.assign(num_tiles + 1, 0);
+  for (auto& tri : chunk->triangles) {
+    for (int32_t ty = tri.bbox.top / TILE_SIZE; ty <= (tri.bbox.bottom - 1) / TILE_SIZE; ++ty) {
+      for (int32_t tx = tri.bbox.left / TILE_SIZE; tx <= (tri.bbox.right - 1) / TILE_SIZE; ++tx) {
+        ++chunk->offsets[ty * tiles_x + tx + 1];
+      }
+    }
+  }
+  for (uint32_t t = 0; t < num_tiles; ++t) {
+    chunk->offsets[t + 1] += chunk->offsets[t];
+  }
+
+  chunk->entries.resize(chunk->offsets[num_tiles]);
+  std::vector<uint32_t> cursors(chunk->offsets.begin(), chunk->offsets.end() - 1);
+  for (uint32_t i = 0; i < chunk->triangles.size(); ++i) {
+    auto& tri = chunk->triangles[i];
+    for (int32_t ty = tri.bbox.top / TILE_SIZE; ty <= (tri.bbox.bottom - 1) / TILE_SIZE; ++ty) {
+      for (int32_t tx = tri.bbox.left / TILE_SIZE; tx <= (tri.bbox.right - 1) / TILE_SIZE; ++tx) {
+        chunk->entries[cursors[ty * tiles_x + tx]++] = i;
+      }
+    }
+  }
+}
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CGLRasterizer::CGLRasterizer(uint32_t num_threads) {
+  color_.format = FORMAT_A8R8G8B8;
+  color_.width  = 0;
+  color_.height = 0;
+  color_.pitch  = 0;
+  depth_.format = FORMAT_X8S8D16;
+  depth_.width  = 0;
+  depth_.height = 0;
+  depth_.pitch  = 0;
+  if (0 == num_threads) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (num_threads > 1) {
+    pool_.reset(new WorkerPool(num_threads));
+  }
+}
+
+CGLRasterizer::~CGLRasterizer() {}
+
+int CGLRasterizer::resize(uint32_t width, uint32_t height) {
+  for (auto surface : {&color_, &depth_}) {
+    surface->width  = width;
+    surface->height = height;
+    surface->pitch  = width * Format::GetInfo(surface->format).BytePerPixel;
+    surface->pixels.resize(size_t(surface->pitch) * height);
+  }
+  this->clear();
+  return 0;
+}
+
+void CGLRasterizer::clear(uint32_t color, uint16_t depth, uint8_t stencil) {
+  uint8_t value[4];
+  uint32_t bpp = Format::GetInfo(color_.format).BytePerPixel;
+  Format::GetConvertTo(color_.format)(value, ColorARGB(color));
+  for (size_t i = 0; i < color_.pixels.size(); i += bpp) {
+    memcpy(&color_.pixels[i], value, bpp);
+  }
+
+  uint32_t depth_value = (uint32_t(stencil) << 16) | depth;
+  bpp = Format::GetInfo(depth_.format).BytePerPixel;
+  for (size_t i = 0; i < depth_.pixels.size(); i += bpp) {
+    memcpy(&depth_.pixels[i], &depth_value, bpp);
+  }
+}
+
+int CGLRasterizer::setFormats(const CGLTrace::states_t& states) {
+  if (!is_color_format(states.color_format)) {
+    std::cerr << "unsupported color format: " << states.color_format << "!" << std::endl;
+    return -1;
+  }
+  if (states.color_format != color_.format) {
+    std::vector<uint8_t> pixels;
+    if (!color_.pixels.empty()
+     && ConvertImage(pixels, states.color_format, color_.pixels.data(), color_.format,
+                     color_.width, color_.height, color_.pitch))
+      return -1;
+    color_.format = states.color_format;
+    color_.pitch  = color_.width * Format::GetInfo(color_.format).BytePerPixel;
+    color_.pixels.swap(pixels);
+  }
+
+  if (states.depth_format == FORMAT_UNKNOWN)
+    return 0;
+  if (!is_depth_format(states.depth_format)) {
+    std::cerr << "unsupported depth format: " << states.depth_format << "!" << std::endl;
+    return -1;
+  }
+  if (states.depth_format != depth_.format) {
+    // depth is kept, stencil is cleared
+    uint32_t src_bpp = Format::GetInfo(depth_.format).BytePerPixel;
+    uint32_t dst_bpp = Format::GetInfo(states.depth_format).BytePerPixel;
+    size_t count = size_t(depth_.width) * depth_.height;
+    std::vector<uint8_t> pixels(count * dst_bpp);
+    for (size_t i = 0; i < count; ++i) {
+      uint16_t value;
+      memcpy(&value, &depth_.pixels[i * src_bpp], 2);
+      memcpy(&pixels[i * dst_bpp], &value, 2);
+    }
+    depth_.format = states.depth_format;
+    depth_.pitch  = depth_.width * dst_bpp;
+    depth_.pixels.swap(pixels);
+  }
+
+  return 0;
+}
+
+int CGLRasterizer::draw(const CGLTrace::drawcall_t& drawcall,
+                        const CGLTrace::texture_t* texture) {
+  if (this->setFormats(drawcall.states))
+    return -1;
+
+  if (pool_)
+    return this->drawTiles({{&drawcall, texture}});
+
+  pipeline_t pipe;
+  if (init_pipeline(drawcall, texture, color_, depth_, &pipe)
+   || check_primitives(drawcall))
+    return -1;
+
+  auto scissor = get_scissor(drawcall.viewport, color_);
+  auto num_vertices = drawcall.vertices.size();
+  vertex_buffer_t vertices;
+  vertices.clip.resize(num_vertices);
+  vertices.screen.resize(num_vertices);
+  vertices.codes.resize(num_vertices);
+  transform_vertices(drawcall, 0, num_vertices, &vertices);
+
+  std::vector<triangle_t> triangles;
+  setup_primitives(drawcall, 0, drawcall.primitives.size(), vertices, scissor, pipe, &triangles);
+  for (auto& tri : triangles) {
+    raster_triangle(pipe, tri, scissor);
+  }
+
+  return 0;
+}
+
+int CGLRasterizer::drawTiles(const std::vector<batch_entry_t>& batch) {
+  if (batch.empty())
+    return 0;
+
+  // entries past a failing one are dropped, like the serial path
+  int status = 0;
+  std::vector<tiled_draw_t> draws(batch.size());
+  uint32_t count = 0;
+  for (; count < batch.size(); ++count) {
+    auto& drawcall = *batch[count].drawcall;
+    auto& draw = draws[count];
+    if (init_pipeline(drawcall, batch[count].texture, color_, depth_, &draw.pipe)
+     || check_primitives(drawcall)) {
+      status = -1;
+      break;
+    }
+    draw.scissor = get_scissor(drawcall.viewport, color_);
+    auto num_vertices = drawcall.vertices.size();
+    draw.vertices.clip.resize(num_vertices);
+    draw.vertices.screen.resize(num_vertices);
+    draw.vertices.codes.resize(num_vertices);
+  }
+
+  struct range_t {
+    uint32_t draw;
+    size_t begin;
+    size_t end;
+  };
+  std::vector<range_t> ranges;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto num_vertices = batch[i].drawcall->vertices.size();
+    for (size_t begin = 0; begin < num_vertices; begin += VERTEX_CHUNK) {
+      ranges.push_back({i, begin, std::min<size_t>(begin + VERTEX_CHUNK, num_vertices)});
+    }
+  }
+  pool_->run(ranges.size(), [&](size_t task) {
+    auto& range = ranges[task];
+    transform_vertices(*batch[range.draw].drawcall, range.begin, range.end,
+                       &draws[range.draw].vertices);
+  });
+
+  uint32_t tiles_x = (color_.width + TILE_SIZE - 1) / TILE_SIZE;
+  uint32_t tiles_y = (color_.height + TILE_SIZE - 1) / TILE_SIZE;
+  std::vector<bin_chunk_t> chunks;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto num_primitives = batch[i].drawcall->primitives.size();
+    for (size_t begin = 0; begin < num_primitives; begin += PRIMITIVE_CHUNK) {
+      bin_chunk_t chunk;
+      chunk.draw  = i;
+      chunk.begin = begin;
+      chunk.end   = std::min<size_t>(begin + PRIMITIVE_CHUNK, num_primitives);
+      chunks.push_back(std::move(chunk));
+    }
+  }
+  pool_->run(chunks.size(), [&](size_t task) {
+    auto& chunk = chunks[task];
+    auto& draw = draws[chunk.draw];
+    setup_primitives(*batch[chunk.draw].drawcall, chunk.begin, chunk.end,
+                     draw.vertices, draw.scissor, draw.pipe, &chunk.triangles);
+    bin_triangles(&chunk, tiles_x, tiles_y);
+  });
+
+  // tiles own their pixels, chunks are visited in submission order
+  pool_->run(size_t(tiles_x) * tiles_y, [&](size_t tile) {
+    TRect<int32_t> rect;
+    rect.left   = int32_t(tile % tiles_x) * TILE_SIZE;
+    rect.top    = int32_t(tile / tiles_x) * TILE_SIZE;
+    rect.right  = std::min<int32_t>(rect.left + TILE_SIZE, color_.width);
+    rect.bottom = std::min<int32_t>(rect.top + TILE_SIZE, color_.height);
+    for (auto& chunk : chunks) {
+      auto& pipe = draws[chunk.draw].pipe;
+      for (auto k = chunk.offsets[tile]; k < chunk.offsets[tile + 1]; ++k) {
+        raster_triangle(pipe, chunk.triangles[chunk.entries[k]], rect);
+      }
+    }
+  });
+
+  return status;
+}
+
+int CGLRasterizer::replay(const CGLTrace& trace) {
+  if (color_.pixels.empty()) {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    for (auto& drawcall : trace.drawcalls) {
+      auto& viewport = drawcall.viewport;
+      width  = std::max<int32_t>(width, std::max(viewport.left, viewport.right));
+      height = std::max<int32_t>(height, std::max(viewport.top, viewport.bottom));
+    }
+    this->resize(width, height);
+  } else {
+    this->clear();
+  }
+
+  std::vector<batch_entry_t> batch;
+  size_t batch_primitives = 0;
+  for (auto& drawcall : trace.drawcalls) {
+    const CGLTrace::texture_t* texture = nullptr;
+    if (drawcall.states.texture_enabled) {
+      auto it = trace.textures.find(drawcall.texture_id);
+      if (it != trace.textures.end()) {
+        texture = &it->second;
+      }
+    }
+    if (!pool_) {
+      if (this->draw(drawcall, texture))
+        return -1;
+      continue;
+    }
+
+    // a format switch converts the render targets, flush first
+    auto& states = drawcall.states;
+    if (states.color_format != color_.format
+     || (states.depth_format != FORMAT_UNKNOWN && states.depth_format != depth_.format)) {
+      if (this->drawTiles(batch))
+        return -1;
+      batch.clear();
+      batch_primitives = 0;
+      if (this->setFormats(states))
+        return -1;
+    }
+    batch.push_back({&drawcall, texture});
+    batch_primitives += drawcall.primitives.size();
+    if (batch.size() >= BATCH_DRAWCALLS || batch_primitives >= BATCH_PRIMITIVES) {
+      if (this->drawTiles(batch))
+        return -1;
+      batch.clear();
+      batch_primitives = 0;
+    }
+  }
+
+  return this->drawTiles(batch);
+}
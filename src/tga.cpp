@@ -1,4 +1,5 @@
 #include "tga.hpp"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -24,31 +25,41 @@ int cocogfx::LoadTGA(const char *filename,
                      uint32_t *width, 
                      uint32_t *height,
                      uint32_t *bpp) {
+  ImageBufferSink sink(pixels);
+  int ret = LoadTGA(filename, sink);
+  if (ret)
+    return ret;
+
+  *bpp    = Format::GetInfo(sink.format()).BytePerPixel; 
+  *width  = sink.width();
+  *height = sink.height(); 
+
+  return 0;
+}
+
+int cocogfx::LoadTGA(const char *filename, 
+                     ImageSink &sink) {
   std::ifstream ifs(filename, std::ios::in | std::ios::binary);
   if (!ifs.is_open()) {
     std::cerr << "couldn't open file: " << filename << "!" << std::endl;
     return -1;
   }
+  return LoadTGA(ifs, sink);
+}
 
-  tga_header_t header;
-  ifs.read(reinterpret_cast<char *>(&header), sizeof(tga_header_t));
-  if (ifs.fail()) {
+static int read_header(std::istream &is, tga_header_t* header) {
+  is.read(reinterpret_cast<char *>(header), sizeof(tga_header_t));
+  if (is.fail()) {
     std::cerr << "invalid TGA file header!" << std::endl;
     return -1;
   }
 
-  if (header.imagetype != 2) {
+  if (header->imagetype != 2) {
     std::cerr << "unsupported TGA encoding format!" << std::endl;
     return -1;
   }
 
-  ifs.seekg(header.idlength, std::ios::cur); // skip string
-  if (ifs.fail()) {
-    std::cerr << "invalid TGA file!" << std::endl;
-    return -1;
-  }
-
-  switch (header.bitsperpixel) {
+  switch (header->bitsperpixel) {
   case 16:
   case 24:
   case 32:
@@ -58,20 +69,76 @@ int cocogfx::LoadTGA(const char *filename,
     return -1;
   } 
 
-  // Read pixels data
-  auto stride = header.bitsperpixel / 8;
-  pixels.resize(stride * header.width * header.height);
-  ifs.read((char*)pixels.data(), pixels.size());
-  if (ifs.fail()) {
+  return 0;
+}
+
+int cocogfx::ProbeTGA(std::istream &is, 
+                      uint32_t *width,
+                      uint32_t *height,
+                      uint32_t *channels,
+                      ePixelFormat *format) {
+  tga_header_t header;
+  int ret = read_header(is, &header);
+  if (ret)
+    return ret;
+
+  *width  = (uint16_t)header.width;
+  *height = (uint16_t)header.height;
+  *channels = (header.bitsperpixel == 32) ? 4 : 3;
+  *format = GetImageFormat(header.bitsperpixel / 8);
+
+  return 0;
+}
+
+int cocogfx::LoadTGA(std::istream &is, 
+                     ImageSink &sink) {
+  tga_header_t header;
+  int ret = read_header(is, &header);
+  if (ret)
+    return ret;
+
+  is.seekg(header.idlength, std::ios::cur); // skip string
+  if (is.fail()) {
     std::cerr << "invalid TGA file!" << std::endl;
     return -1;
-  }   
+  }
 
-  *bpp    = stride; 
-  *width  = header.width;
-  *height = header.height; 
+  uint32_t stride = header.bitsperpixel / 8;
+  uint32_t width  = (uint16_t)header.width;
+  uint32_t height = (uint16_t)header.height;
+
+  ret = sink.begin(width, height, GetImageFormat(stride));
+  if (ret)
+    return ret;
+
+  // rows are stored bottom-up unless the top-left origin bit is set
+  bool bottom_up = !(header.imagedescriptor & 0x20);
+  auto data_start = is.tellg();
+
+  // Read pixels data in bands, top to bottom
+  uint32_t pitch = stride * width;
+  uint32_t band_rows = GetBandRows(pitch);
+  std::vector<uint8_t> rows(band_rows * pitch);
+  for (uint32_t y = 0; y < height; y += band_rows) {
+    uint32_t count = std::min(band_rows, height - y);
+    if (bottom_up) {
+      is.seekg(data_start + std::streamoff(height - y - count) * pitch);
+    }
+    is.read((char*)rows.data(), count * pitch);
+    if (is.fail()) {
+      std::cerr << "invalid TGA file!" << std::endl;
+      return -1;
+    }
+    if (bottom_up) {
+      ret = sink.writeRows(rows.data() + (count - 1) * pitch, y, count, -(int32_t)pitch);
+    } else {
+      ret = sink.writeRows(rows.data(), y, count, pitch);
+    }
+    if (ret)
+      return ret;
+  }
 
-  return 0;
+  return sink.finish();
 }
 
 int cocogfx::SaveTGA(const char *filename, 
@@ -80,17 +147,51 @@ int cocogfx::SaveTGA(const char *filename,
                      uint32_t height, 
                      uint32_t bpp,
                      int32_t pitch) {              
-  std::ofstream ofs(filename, std::ios::out | std::ios::binary);
-  if (!ofs.is_open()) {
-    std::cerr << "couldn't create file: " << filename << "!" << std::endl;
-    return -1;
-  }
+  TGAWriter writer(filename);
+  int ret = writer.begin(width, height, GetImageFormat(bpp));
+  if (ret)
+    return ret;
+
+  ret = writer.writeRows(pixels, 0, height, pitch);
+  if (ret)
+    return ret;
 
+  return writer.finish();
+}
+
+TGAWriter::TGAWriter(const char *filename)
+  : filename_(filename)
+  , os_(nullptr)
+  , row_size_(0)
+  , height_(0)
+  , next_row_(0)
+{}
+
+TGAWriter::TGAWriter(std::ostream &os)
+  : os_(&os)
+  , row_size_(0)
+  , height_(0)
+  , next_row_(0)
+{}
+
+int TGAWriter::begin(uint32_t width, 
+                     uint32_t height, 
+                     ePixelFormat format) {
+  uint32_t bpp = Format::GetInfo(format).BytePerPixel;
   if (bpp < 2 || bpp > 4) {        
     std::cerr << "unsupported pixel stride: " << bpp << "!" << std::endl;
     return -1;
   }
 
+  if (nullptr == os_) {
+    ofs_.open(filename_.c_str(), std::ios::out | std::ios::binary);
+    if (!ofs_.is_open()) {
+      std::cerr << "couldn't create file: " << filename_ << "!" << std::endl;
+      return -1;
+    }
+    os_ = &ofs_;
+  }
+
   tga_header_t header;
   header.idlength = 0;
   header.colormaptype = 0; // no palette
@@ -103,21 +204,46 @@ int cocogfx::SaveTGA(const char *filename,
   header.width = width;
   header.height = height;
   header.bitsperpixel = bpp * 8;
-  header.imagedescriptor = 0;
+  header.imagedescriptor = 0x20; // top-left origin
 
   // write header
-  ofs.write(reinterpret_cast<char *>(&header), sizeof(tga_header_t));
+  os_->write(reinterpret_cast<char *>(&header), sizeof(tga_header_t));
+
+  row_size_ = width * bpp;
+  height_   = height;
+  next_row_ = 0;
+
+  return os_->fail() ? -1 : 0;
+}
+
+int TGAWriter::writeRows(const uint8_t* rows, 
+                         uint32_t y, 
+                         uint32_t count, 
+                         int32_t pitch) {
+  if (nullptr == os_ || y != next_row_ || y + count > height_) {
+    std::cerr << "out of order TGA rows!" << std::endl;
+    return -1;
+  }
 
   // write pixel data
-  const uint8_t* pixel_bytes = pixels + (height - 1) * pitch;
-  for (uint32_t y = 0; y < height; ++y) {
-    const uint8_t* pixel_row = pixel_bytes;
-    for (uint32_t x = 0; x < width; ++x) {
-      ofs.write((const char*)pixel_row, bpp);      
-      pixel_row += bpp;
-    }
-    pixel_bytes -= pitch;
+  for (uint32_t i = 0; i < count; ++i) {
+    os_->write((const char*)rows, row_size_);
+    rows += pitch;
   }
+  next_row_ += count;
 
-  return 0;
-}
\ No newline at end of file
+  return os_->fail() ? -1 : 0;
+}
+
+int TGAWriter::finish() {
+  if (nullptr == os_ || next_row_ != height_) {
+    std::cerr << "incomplete TGA image!" << std::endl;
+    return -1;
+  }
+  if (os_ == &ofs_) {
+    ofs_.close();
+  } else {
+    os_->flush();
+  }
+  return os_->fail() ? -1 : 0;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cocogfx {
+
+// Fixed set of threads running indexed tasks. Each run splits the tasks
+// evenly across per-thread queues, threads pop from the front of their own
+// queue and steal from the back of the others once it is empty.
+// The calling thread takes part as worker 0. A run issued from inside a
+// task, or while another thread is using the pool, executes on the caller.
+class WorkerPool {
+public:
+  // 0 uses all hardware threads
+  explicit WorkerPool(uint32_t num_threads)
+    : task_fn_(nullptr)
+    , generation_(0)
+    , active_(0)
+    , exit_(false)
+    , busy_(false) {
+    if (0 == num_threads) {
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    queues_.resize(num_threads);
+    for (auto& queue : queues_) {
+      queue.reset(new queue_t());
+    }
+    for (uint32_t t = 1; t < num_threads; ++t) {
+      threads_.emplace_back([this, t]() { this->work(t); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      exit_ = true;
+    }
+    start_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  // process-wide pool with one thread per core
+  static WorkerPool& Shared() {
+    static WorkerPool pool(0);
+    return pool;
+  }
+
+  uint32_t size() const {
+    return queues_.size();
+  }
+
+  // call fn for every task in [0, count), returns once all are done
+  void run(size_t count, const std::function<void(size_t)>& fn) {
+    bool idle = false;
+    if (count <= 1
+     || threads_.empty()
+     || !busy_.compare_exchange_strong(idle, true)) {
+      for (size_t i = 0; i < count; ++i) {
+        fn(i);
+      }
+      return;
+    }
+
+    auto num_queues = queues_.size();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_fn_ = &fn;
+      for (size_t q = 0; q < num_queues; ++q) {
+        std::lock_guard<std::mutex> queue_lock(queues_[q]->mutex);
+        for (size_t i = q * count / num_queues; i < (q + 1) * count / num_queues; ++i) {
+          queues_[q]->tasks.push_back(i);
+        }
+      }
+      ++generation_;
+    }
+    start_.notify_all();
+
+    this->drain(0);
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [&]() { return 0 == active_; });
+    }
+    busy_ = false;
+  }
+
+private:
+  WorkerPool(const WorkerPool&);
+  WorkerPool& operator=(const WorkerPool&);
+
+  struct queue_t {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
+
+  void work(uint32_t id) {
+    uint64_t generation = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_.wait(lock, [&]() { return exit_ || generation != generation_; });
+        if (exit_)
+          return;
+        generation = generation_;
+        ++active_;
+      }
+      this->drain(id);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (0 == --active_) {
+          done_.notify_all();
+        }
+      }
+    }
+  }
+
+  void drain(uint32_t id) {
+    size_t task;
+    while (this->pop(id, &task)) {
+      (*task_fn_)(task);
+    }
+  }
+
+  bool pop(uint32_t id, size_t* task) {
+    {
+      auto& queue = *queues_[id];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty()) {
+        *task = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i) {
+      auto& victim = *queues_[(id + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        *task = victim.tasks.back();
+        victim.tasks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<std::unique_ptr<queue_t>> queues_;
+  std::vector<std::thread> threads_;
+  const std::function<void(size_t)>* task_fn_;
+  uint64_t generation_;
+  uint32_t active_;
+  bool exit_;
+  std::atomic<bool> busy_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+};
+
+}